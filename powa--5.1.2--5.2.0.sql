@@ -1148,11 +1148,1726 @@ END;
 $PROC$ LANGUAGE plpgsql; /* end of powa_stat_lock_src */
 
 
+/*
+ * Generate the query used by powa_export_history() to retrieve all the records
+ * of the given coalesced history relation and its *_current counterpart.  The
+ * generated query expects 3 parameters: the server id and the lower and upper
+ * bounds of the wanted time range.
+ */
+CREATE FUNCTION @extschema@.powa_export_history_query(_relname text)
+RETURNS text AS $_$
+DECLARE
+    v_oid oid;
+    v_reccol name;
+    v_rectype oid;
+    v_keys text;
+    v_curkeys text;
+    v_current text;
+    v_curoid oid;
+    v_curcol name;
+    v_fields text;
+    v_ts text;
+    v_sql text;
+BEGIN
+    SELECT c.oid INTO v_oid
+    FROM pg_catalog.pg_class c
+    JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace
+    WHERE quote_ident(n.nspname) = '@extschema@'
+    AND c.relname = _relname;
+
+    -- the coalesced records are stored in the only array of composite column
+    BEGIN
+        SELECT a.attname, t.typelem INTO STRICT v_reccol, v_rectype
+        FROM pg_catalog.pg_attribute a
+        JOIN pg_catalog.pg_type t ON t.oid = a.atttypid
+        JOIN pg_catalog.pg_type et ON et.oid = t.typelem
+        WHERE a.attrelid = v_oid
+        AND a.attnum > 0 AND NOT a.attisdropped
+        AND et.typtype = 'c'
+        AND EXISTS (SELECT 1
+            FROM pg_catalog.pg_attribute r
+            WHERE r.attrelid = v_oid
+            AND r.attname = 'coalesce_range'
+        );
+    EXCEPTION WHEN no_data_found OR too_many_rows THEN
+        RAISE EXCEPTION 'relation "%" is not a supported history relation',
+            _relname;
+    END;
+
+    SELECT string_agg(quote_ident(a.attname), ', ' ORDER BY a.attnum)
+    INTO v_keys
+    FROM pg_catalog.pg_attribute a
+    WHERE a.attrelid = v_oid
+    AND a.attnum > 0 AND NOT a.attisdropped
+    AND a.attname NOT IN ('coalesce_range', 'mins_in_range', 'maxs_in_range')
+    AND a.attname != v_reccol;
+
+    -- the pending migration jobs conversions, if any, are applied to the records
+    v_sql := format('SELECT %1$s, (h.%3$I).*
+FROM (
+    SELECT %1$s, unnest(@extschema@.powa_migration_read(%3$I)) AS %3$I
+    FROM @extschema@.%2$I
+    WHERE srvid = $1
+    AND coalesce_range && tstzrange($2, $3, ''[]'')
+    AND upper(coalesce_range) >= $2
+) h
+WHERE (h.%3$I).ts >= $2
+AND (h.%3$I).ts <= $3',
+        v_keys, _relname, v_reccol);
+
+    -- add the not yet coalesced records, if any
+    IF _relname ~ '_db$' THEN
+        v_current := regexp_replace(_relname, '_db$', '_current_db');
+    ELSE
+        v_current := _relname || '_current';
+    END IF;
+
+    SELECT c.oid INTO v_curoid
+    FROM pg_catalog.pg_class c
+    JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace
+    WHERE quote_ident(n.nspname) = '@extschema@'
+    AND c.relname = v_current;
+
+    IF v_curoid IS NULL THEN
+        RETURN v_sql;
+    END IF;
+
+    SELECT a.attname INTO v_curcol
+    FROM pg_catalog.pg_attribute a
+    WHERE a.attrelid = v_curoid
+    AND a.attnum > 0 AND NOT a.attisdropped
+    AND a.atttypid = v_rectype;
+
+    IF v_curcol IS NOT NULL THEN
+        v_fields := 'r.*';
+        v_ts := format('(c.%I).ts', v_curcol);
+    ELSE
+        -- some *_current tables store the record fields as plain columns
+        SELECT string_agg(quote_ident(a.attname), ', ' ORDER BY a.attnum)
+        INTO v_fields
+        FROM pg_catalog.pg_type t
+        JOIN pg_catalog.pg_attribute a ON a.attrelid = t.typrelid
+        WHERE t.oid = v_rectype
+        AND a.attnum > 0 AND NOT a.attisdropped;
+        v_ts := 'c.ts';
+    END IF;
+
+    -- the keys are qualified as the record fields are also in scope
+    SELECT string_agg(format('c.%I', a.attname), ', ' ORDER BY a.attnum)
+    INTO v_curkeys
+    FROM pg_catalog.pg_attribute a
+    WHERE a.attrelid = v_oid
+    AND a.attnum > 0 AND NOT a.attisdropped
+    AND a.attname NOT IN ('coalesce_range', 'mins_in_range', 'maxs_in_range')
+    AND a.attname != v_reccol;
+
+    v_sql := v_sql || format('
+UNION ALL
+SELECT %1$s, %3$s
+FROM @extschema@.%2$I c%5$s
+WHERE c.srvid = $1
+AND %4$s >= $2
+AND %4$s <= $3',
+        v_curkeys, v_current, v_fields, v_ts,
+        CASE WHEN v_curcol IS NOT NULL
+            THEN format(',
+LATERAL @extschema@.powa_migration_read(c.%I) r', v_curcol)
+            ELSE ''
+        END);
+
+    RETURN v_sql;
+END;
+$_$ LANGUAGE plpgsql STABLE
+SET search_path = pg_catalog; /* end of powa_export_history_query */
+
+/*
+ * Export the records of a coalesced history relation for the given server and
+ * time range as an Arrow IPC stream, either returned as a set of bytea (one
+ * per Arrow message) or written to a server-side file.
+ */
+CREATE FUNCTION @extschema@.powa_export_history(_srvid integer,
+    _relname text,
+    _from timestamp with time zone DEFAULT '-infinity',
+    _to timestamp with time zone DEFAULT 'infinity')
+    RETURNS SETOF bytea
+    LANGUAGE c STRICT COST 1000
+AS '$libdir/powa', 'powa_export_history';
+
+CREATE FUNCTION @extschema@.powa_export_history_to_file(_srvid integer,
+    _relname text,
+    _from timestamp with time zone,
+    _to timestamp with time zone,
+    _path text)
+    RETURNS bigint
+    LANGUAGE c STRICT COST 1000
+AS '$libdir/powa', 'powa_export_history_to_file';
+
+-- Servers for which the optional co-located per-query history layout is
+-- activated, see powa_activate_query_history()
+CREATE TABLE @extschema@.powa_query_history_config (
+    srvid integer NOT NULL PRIMARY KEY,
+    enabled_at timestamp with time zone NOT NULL default now(),
+    FOREIGN KEY (srvid) REFERENCES @extschema@.powa_servers(id)
+      MATCH FULL ON UPDATE CASCADE ON DELETE CASCADE
+);
+
+CREATE OR REPLACE VIEW @extschema@.powa_all_functions AS
+    SELECT *
+    FROM @extschema@.powa_functions
+    UNION ALL
+    SELECT srvid, 'db_module' AS kind, db_module AS name, operation, external,
+        function_name, NULL as query_source, NULL AS query_cleanup, enabled,
+        priority
+    FROM @extschema@.powa_db_modules pdm
+    JOIN @extschema@.powa_db_module_config pdmc USING (db_module)
+    JOIN @extschema@.powa_db_module_functions pdmf USING (db_module)
+    UNION ALL
+    -- the per-query history has to be aggregated before its data sources
+    SELECT srvid, 'query_history' AS kind, 'query_history' AS name, operation,
+        false, function_name, NULL AS query_source, NULL AS query_cleanup,
+        true, priority
+    FROM @extschema@.powa_query_history_config
+    CROSS JOIN (VALUES
+        ('aggregate', 'powa_query_history_aggregate', 5::numeric),
+        ('purge',     'powa_query_history_purge',     10),
+        ('reset',     'powa_query_history_reset',     10)
+    ) f(operation, function_name, priority);
+
+/*
+ * Optional co-located per-query history layout.
+ *
+ * Once activated for a server with powa_activate_query_history(), the
+ * pg_stat_statements, pg_stat_kcache and pg_wait_sampling records of each
+ * query are also coalesced together in powa_query_history, one record per
+ * snapshot.  powa_get_query_history() can then read the coalesced part of any
+ * time range from a single relation rather than joining the three data
+ * sources, at the price of storing those metrics twice and of an additional
+ * INSERT each time the data sources are coalesced.
+ *
+ * The wait events are stored as a jsonb document of the form
+ * {"event_type": {"event": count}}.
+ */
+CREATE TYPE @extschema@.powa_query_history_record AS (
+    ts timestamp with time zone,
+    statements @extschema@.powa_statements_history_record,
+    kcache @extschema@.powa_kcache_history_record,
+    wait_events jsonb
+);
+
+CREATE TABLE @extschema@.powa_query_history (
+    srvid integer NOT NULL,
+    coalesce_range tstzrange NOT NULL,
+    queryid bigint NOT NULL,
+    dbid oid NOT NULL,
+    userid oid NOT NULL,
+    toplevel boolean NOT NULL,
+    records @extschema@.powa_query_history_record[] NOT NULL,
+    PRIMARY KEY (srvid, coalesce_range, queryid, dbid, userid, toplevel),
+    FOREIGN KEY (srvid) REFERENCES @extschema@.powa_servers(id)
+      MATCH FULL ON UPDATE CASCADE ON DELETE CASCADE
+);
+
+CREATE INDEX powa_query_history_query_ts ON @extschema@.powa_query_history USING gist (srvid, queryid, coalesce_range);
+
+SELECT pg_catalog.pg_extension_config_dump('@extschema@.powa_query_history','');
+SELECT pg_catalog.pg_extension_config_dump('@extschema@.powa_query_history_config','');
+
+/*
+ * Activate the co-located per-query history layout for the given server.
+ * The statements are the driving data source, so pg_stat_statements has to
+ * be activated for that server first.
+ */
+CREATE FUNCTION @extschema@.powa_activate_query_history(_srvid integer)
+RETURNS boolean AS $_$
+BEGIN
+    IF (_srvid IS NULL) THEN
+        RAISE EXCEPTION 'powa_activate_query_history: no server id provided';
+    END IF;
+
+    IF NOT EXISTS (SELECT 1
+                   FROM @extschema@.powa_extension_config
+                   WHERE srvid = _srvid
+                   AND extname = 'pg_stat_statements'
+                   AND enabled)
+    THEN
+        RAISE WARNING 'pg_stat_statements is not activated for server %, ignoring',
+                      _srvid;
+        RETURN false;
+    END IF;
+
+    INSERT INTO @extschema@.powa_query_history_config (srvid)
+    VALUES (_srvid)
+    ON CONFLICT (srvid) DO NOTHING;
+
+    RETURN true;
+END;
+$_$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_activate_query_history */
+
+-- Deactivate the co-located per-query history layout for the given server,
+-- and remove its now useless data.
+CREATE FUNCTION @extschema@.powa_deactivate_query_history(_srvid integer)
+RETURNS boolean AS $_$
+BEGIN
+    IF (_srvid IS NULL) THEN
+        RAISE EXCEPTION 'powa_deactivate_query_history: no server id provided';
+    END IF;
+
+    DELETE FROM @extschema@.powa_query_history_config WHERE srvid = _srvid;
+    PERFORM @extschema@.powa_query_history_reset(_srvid);
+
+    RETURN true;
+END;
+$_$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_deactivate_query_history */
+
+CREATE FUNCTION @extschema@.powa_query_history_aggregate(_srvid integer)
+RETURNS void AS $PROC$
+DECLARE
+    v_funcname    text := format('@extschema@.%I(%s)',
+                                 'powa_query_history_aggregate', _srvid);
+    v_rowcount    bigint;
+BEGIN
+    PERFORM @extschema@.powa_log(format('running %s', v_funcname));
+
+    PERFORM @extschema@.powa_prevent_concurrent_snapshot(_srvid);
+
+    -- This has to run before the data sources aggregation, which removes the
+    -- records we read here.  The pending migration jobs conversions, if any,
+    -- are applied as they won't process the co-located records.  pg_wait_sampling doesn't track the user nor the
+    -- toplevel flag.
+    INSERT INTO @extschema@.powa_query_history (srvid, coalesce_range,
+            queryid, dbid, userid, toplevel, records)
+        SELECT _srvid, tstzrange(min((s.record).ts), max((s.record).ts),'[]'),
+            s.queryid, s.dbid, s.userid, s.toplevel,
+            array_agg(ROW((s.record).ts, @extschema@.powa_migration_read(s.record),
+                @extschema@.powa_migration_read(k.metrics), w.wait_events
+                )::@extschema@.powa_query_history_record
+                ORDER BY (s.record).ts)
+        FROM @extschema@.powa_statements_history_current s
+        LEFT JOIN @extschema@.powa_kcache_metrics_current k
+            ON k.srvid = _srvid AND k.queryid = s.queryid
+            AND k.dbid = s.dbid AND k.userid = s.userid
+            AND k.top = s.toplevel AND (k.metrics).ts = (s.record).ts
+        LEFT JOIN (
+            SELECT e.queryid, e.dbid, e.ts,
+                jsonb_object_agg(e.event_type, e.events) AS wait_events
+            FROM (
+                SELECT h.queryid, h.dbid, (h.record).ts, h.event_type,
+                    jsonb_object_agg(h.event,
+                        (@extschema@.powa_migration_read(h.record)).count)
+                        AS events
+                FROM @extschema@.powa_wait_sampling_history_current h
+                WHERE h.srvid = _srvid
+                GROUP BY h.queryid, h.dbid, (h.record).ts, h.event_type
+            ) e
+            GROUP BY e.queryid, e.dbid, e.ts
+        ) w ON w.queryid = s.queryid AND w.dbid = s.dbid
+            AND w.ts = (s.record).ts
+        WHERE s.srvid = _srvid
+        GROUP BY s.queryid, s.dbid, s.userid, s.toplevel;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    PERFORM @extschema@.powa_log(format('%s - rowcount: %s',
+            v_funcname, v_rowcount));
+END;
+$PROC$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_query_history_aggregate */
+
+CREATE FUNCTION @extschema@.powa_query_history_purge(_srvid integer)
+RETURNS void AS $PROC$
+DECLARE
+    v_funcname    text := format('@extschema@.%I(%s)',
+                                 'powa_query_history_purge', _srvid);
+    v_rowcount    bigint;
+    v_retention   interval;
+BEGIN
+    PERFORM @extschema@.powa_log(format('running %s', v_funcname));
+
+    PERFORM @extschema@.powa_prevent_concurrent_snapshot(_srvid);
+
+    -- Same retention as the driving data source
+    SELECT @extschema@.powa_get_server_retention(_srvid,'pg_stat_statements','extension'::@extschema@.datasource_type) INTO v_retention;
+
+    DELETE FROM @extschema@.powa_query_history
+    WHERE upper(coalesce_range) < (now() - v_retention)
+    AND srvid = _srvid;
+
+    GET DIAGNOSTICS v_rowcount = ROW_COUNT;
+    PERFORM @extschema@.powa_log(format('%s - rowcount: %s',
+            v_funcname, v_rowcount));
+END;
+$PROC$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_query_history_purge */
+
+CREATE FUNCTION @extschema@.powa_query_history_reset(_srvid integer)
+RETURNS boolean AS $PROC$
+BEGIN
+    PERFORM @extschema@.powa_log('Resetting powa_query_history(' || _srvid || ')');
+    DELETE FROM @extschema@.powa_query_history WHERE srvid = _srvid;
+
+    RETURN true;
+END;
+$PROC$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_query_history_reset */
+
+/*
+ * Return the per-interval metrics of a single query, merging the
+ * pg_stat_statements, pg_stat_kcache and pg_wait_sampling data sources.
+ *
+ * Those data sources are all snapshotted by the same powa_take_snapshot()
+ * call and therefore share the same timestamps, so a single row is returned
+ * for each snapshot in the given range with the difference from the previous
+ * snapshot for each data source.  The wait events are returned as a jsonb
+ * document of the form {"event_type": {"event": count}}.
+ *
+ * The pending migration jobs conversions, if any, are applied to all the
+ * records.
+ *
+ * If the co-located per-query history layout is activated for the server,
+ * the data is read from powa_query_history instead, falling back to the data
+ * sources if some of the requested range is missing from it.  Note that this
+ * layout doesn't replace the data sources history: every metric is stored
+ * twice, and each coalesce runs a fourth INSERT for powa_query_history.
+ */
+CREATE FUNCTION @extschema@.powa_get_query_history(
+    _srvid integer,
+    _queryid bigint,
+    _dbid oid,
+    _userid oid,
+    _from timestamp with time zone,
+    _to timestamp with time zone,
+    _toplevel boolean DEFAULT true,
+    OUT ts timestamp with time zone,
+    OUT intvl interval,
+    OUT statements @extschema@.powa_statements_history_diff,
+    OUT kcache @extschema@.powa_kcache_history_diff,
+    OUT wait_events jsonb
+)
+RETURNS SETOF record
+STABLE
+AS $PROC$
+BEGIN
+    -- Use the co-located per-query history if it was already activated for
+    -- the whole requested range, and if it contains all the coalesced
+    -- statements records of that range.  Those can be missing if the
+    -- co-located history aggregation failed while the data sources one
+    -- succeeded, in which case only the data sources have the full history.
+    IF EXISTS (SELECT 1
+               FROM @extschema@.powa_query_history_config c
+               WHERE c.srvid = _srvid AND c.enabled_at <= _from)
+    AND NOT EXISTS (SELECT 1
+                    FROM @extschema@.powa_statements_history s
+                    WHERE s.srvid = _srvid AND s.queryid = _queryid
+                    AND s.dbid = _dbid AND s.userid = _userid
+                    AND s.toplevel = _toplevel
+                    AND s.coalesce_range && tstzrange(_from, _to, '[]')
+                    AND upper(s.coalesce_range) >= _from
+                    AND NOT EXISTS (SELECT 1
+                        FROM @extschema@.powa_query_history h
+                        WHERE h.srvid = _srvid AND h.queryid = _queryid
+                        AND h.dbid = _dbid AND h.userid = _userid
+                        AND h.toplevel = _toplevel
+                        AND h.coalesce_range @> s.coalesce_range
+                    )
+    )
+    THEN
+        RETURN QUERY
+            WITH r AS (
+                -- a record can be both coalesced and still present in the
+                -- data sources if their aggregation failed
+                SELECT DISTINCT ON ((r.rec).ts) r.rec
+                FROM (
+                    -- records not coalesced yet
+                    SELECT ROW((s.record).ts,
+                        @extschema@.powa_migration_read(s.record),
+                        @extschema@.powa_migration_read(k.metrics), w.events
+                        )::@extschema@.powa_query_history_record AS rec
+                    FROM @extschema@.powa_statements_history_current s
+                    LEFT JOIN @extschema@.powa_kcache_metrics_current k
+                        ON k.srvid = _srvid AND k.queryid = _queryid
+                        AND k.dbid = _dbid AND k.userid = _userid
+                        AND k.top = _toplevel
+                        AND (k.metrics).ts = (s.record).ts
+                    LEFT JOIN (
+                        SELECT e.rec_ts, jsonb_object_agg(e.event_type,
+                            e.events) AS events
+                        FROM (
+                            SELECT (h.record).ts AS rec_ts, h.event_type,
+                                jsonb_object_agg(h.event,
+                                    (@extschema@.powa_migration_read(h.record)).count)
+                                    AS events
+                            FROM @extschema@.powa_wait_sampling_history_current h
+                            WHERE h.srvid = _srvid AND h.queryid = _queryid
+                            AND h.dbid = _dbid
+                            GROUP BY (h.record).ts, h.event_type
+                        ) e
+                        GROUP BY e.rec_ts
+                    ) w ON w.rec_ts = (s.record).ts
+                    WHERE s.srvid = _srvid AND s.queryid = _queryid
+                    AND s.dbid = _dbid AND s.userid = _userid
+                    AND s.toplevel = _toplevel
+                    AND (s.record).ts >= _from AND (s.record).ts <= _to
+                    UNION ALL
+                    SELECT u.rec
+                    FROM (
+                        SELECT unnest(@extschema@.powa_migration_read(h.records))
+                            AS rec
+                        FROM @extschema@.powa_query_history h
+                        WHERE h.srvid = _srvid AND h.queryid = _queryid
+                        AND h.dbid = _dbid AND h.userid = _userid
+                        AND h.toplevel = _toplevel
+                        AND h.coalesce_range && tstzrange(_from, _to, '[]')
+                        AND upper(h.coalesce_range) >= _from
+                    ) u
+                    WHERE (u.rec).ts >= _from AND (u.rec).ts <= _to
+                ) r
+                ORDER BY (r.rec).ts
+            ),
+            rec AS (
+                SELECT (r.rec).ts AS rec_ts,
+                    (r.rec).statements OPERATOR(@extschema@.-)
+                        lag((r.rec).statements) OVER w AS pgss_diff,
+                    (r.rec).kcache OPERATOR(@extschema@.-)
+                        lag((r.rec).kcache) OVER w AS kc_diff
+                FROM r
+                WINDOW w AS (ORDER BY (r.rec).ts)
+            ),
+            -- each wait event is compared with its previous occurrence, as
+            -- the data sources do
+            ws AS (
+                SELECT e.rec_ts, jsonb_object_agg(e.event_type, e.events)
+                    AS events
+                FROM (
+                    SELECT d.rec_ts, d.event_type,
+                        jsonb_object_agg(d.event, d.nb) AS events
+                    FROM (
+                        SELECT (r.rec).ts AS rec_ts, et.key AS event_type,
+                            ev.key AS event,
+                            ev.value::numeric - lag(ev.value::numeric) OVER (
+                                PARTITION BY et.key, ev.key
+                                ORDER BY (r.rec).ts) AS nb
+                        FROM r
+                        CROSS JOIN LATERAL jsonb_each((r.rec).wait_events) et
+                        CROSS JOIN LATERAL jsonb_each_text(et.value) ev
+                    ) d
+                    WHERE d.nb IS NOT NULL
+                    GROUP BY d.rec_ts, d.event_type
+                ) e
+                GROUP BY e.rec_ts
+            )
+            SELECT rec.rec_ts,
+                coalesce((rec.pgss_diff).intvl, (rec.kc_diff).intvl),
+                rec.pgss_diff, rec.kc_diff, ws.events
+            FROM rec
+            LEFT JOIN ws ON ws.rec_ts = rec.rec_ts
+            -- ignore the first snapshot of the range, as there's nothing to
+            -- compare it with
+            WHERE rec.pgss_diff IS NOT NULL
+            OR rec.kc_diff IS NOT NULL
+            OR ws.events IS NOT NULL
+            ORDER BY 1;
+
+        RETURN;
+    END IF;
+
+    RETURN QUERY
+        WITH pgss AS (
+            SELECT (r.rec).ts AS rec_ts,
+                r.rec OPERATOR(@extschema@.-)
+                    lag(r.rec) OVER (ORDER BY (r.rec).ts) AS diff
+            FROM (
+                SELECT @extschema@.powa_migration_read(h.record) AS rec
+                FROM @extschema@.powa_statements_history_current h
+                WHERE h.srvid = _srvid AND h.queryid = _queryid
+                AND h.dbid = _dbid AND h.userid = _userid
+                AND h.toplevel = _toplevel
+                AND (h.record).ts >= _from AND (h.record).ts <= _to
+                UNION ALL
+                SELECT u.rec
+                FROM (
+                    SELECT unnest(@extschema@.powa_migration_read(h.records))
+                        AS rec
+                    FROM @extschema@.powa_statements_history h
+                    WHERE h.srvid = _srvid AND h.queryid = _queryid
+                    AND h.dbid = _dbid AND h.userid = _userid
+                    AND h.toplevel = _toplevel
+                    AND h.coalesce_range && tstzrange(_from, _to, '[]')
+                    -- redundant, but usable by the btree history index layout
+                    AND upper(h.coalesce_range) >= _from
+                ) u
+                WHERE (u.rec).ts >= _from AND (u.rec).ts <= _to
+            ) r
+        ),
+        kc AS (
+            SELECT (r.rec).ts AS rec_ts,
+                r.rec OPERATOR(@extschema@.-)
+                    lag(r.rec) OVER (ORDER BY (r.rec).ts) AS diff
+            FROM (
+                SELECT @extschema@.powa_migration_read(h.metrics) AS rec
+                FROM @extschema@.powa_kcache_metrics_current h
+                WHERE h.srvid = _srvid AND h.queryid = _queryid
+                AND h.dbid = _dbid AND h.userid = _userid
+                AND h.top = _toplevel
+                AND (h.metrics).ts >= _from AND (h.metrics).ts <= _to
+                UNION ALL
+                SELECT u.rec
+                FROM (
+                    SELECT unnest(@extschema@.powa_migration_read(h.metrics))
+                        AS rec
+                    FROM @extschema@.powa_kcache_metrics h
+                    WHERE h.srvid = _srvid AND h.queryid = _queryid
+                    AND h.dbid = _dbid AND h.userid = _userid
+                    AND h.top = _toplevel
+                    AND h.coalesce_range && tstzrange(_from, _to, '[]')
+                    AND upper(h.coalesce_range) >= _from
+                ) u
+                WHERE (u.rec).ts >= _from AND (u.rec).ts <= _to
+            ) r
+        ),
+        -- pg_wait_sampling doesn't track the user nor the toplevel flag
+        ws AS (
+            SELECT e.rec_ts, jsonb_object_agg(e.event_type, e.events) AS events
+            FROM (
+                SELECT d.rec_ts, d.event_type,
+                    jsonb_object_agg(d.event, d.nb) AS events
+                FROM (
+                    SELECT (r.rec).ts AS rec_ts, r.event_type, r.event,
+                        (r.rec OPERATOR(@extschema@.-) lag(r.rec) OVER (
+                            PARTITION BY r.event_type, r.event
+                            ORDER BY (r.rec).ts)
+                        ).count AS nb
+                    FROM (
+                        SELECT h.event_type, h.event,
+                            @extschema@.powa_migration_read(h.record) AS rec
+                        FROM @extschema@.powa_wait_sampling_history_current h
+                        WHERE h.srvid = _srvid AND h.queryid = _queryid
+                        AND h.dbid = _dbid
+                        AND (h.record).ts >= _from AND (h.record).ts <= _to
+                        UNION ALL
+                        SELECT u.event_type, u.event, u.rec
+                        FROM (
+                            SELECT h.event_type, h.event,
+                                unnest(@extschema@.powa_migration_read(h.records))
+                                    AS rec
+                            FROM @extschema@.powa_wait_sampling_history h
+                            WHERE h.srvid = _srvid AND h.queryid = _queryid
+                            AND h.dbid = _dbid
+                            AND h.coalesce_range && tstzrange(_from, _to, '[]')
+                            AND upper(h.coalesce_range) >= _from
+                        ) u
+                        WHERE (u.rec).ts >= _from AND (u.rec).ts <= _to
+                    ) r
+                ) d
+                WHERE d.nb IS NOT NULL
+                GROUP BY d.rec_ts, d.event_type
+            ) e
+            GROUP BY e.rec_ts
+        )
+        SELECT coalesce(pgss.rec_ts, kc.rec_ts, ws.rec_ts),
+            coalesce((pgss.diff).intvl, (kc.diff).intvl),
+            pgss.diff, kc.diff, ws.events
+        FROM pgss
+        FULL JOIN kc ON kc.rec_ts = pgss.rec_ts
+        FULL JOIN ws ON ws.rec_ts = coalesce(pgss.rec_ts, kc.rec_ts)
+        -- ignore the first snapshot of the range, as there's nothing to
+        -- compare it with
+        WHERE pgss.diff IS NOT NULL
+        OR kc.diff IS NOT NULL
+        OR ws.events IS NOT NULL
+        ORDER BY 1;
+END;
+$PROC$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_get_query_history */
+
+/*
+ * Index layout of the history tables, see powa_setup_history_indexes().  The
+ * layout is chosen by the extension scripts, so the table isn't dumped: on
+ * restore, CREATE EXTENSION records the layout it creates.
+ */
+CREATE TABLE @extschema@.powa_history_index_config (
+    id boolean NOT NULL PRIMARY KEY DEFAULT true CHECK (id),
+    method text NOT NULL CHECK (method IN ('gist', 'btree'))
+);
+INSERT INTO @extschema@.powa_history_index_config (method) VALUES ('gist');
+
+/*
+ * Servers whose history is stored in their own partitions of the history
+ * tables, see powa_setup_server_partitioning().  The local server is only
+ * present if the history tables are partitioned by server, so this table also
+ * records the chosen layout.  Inserting a row creates the server partitions
+ * if they don't exist yet.
+ */
+CREATE TABLE @extschema@.powa_partitioned_servers (
+    srvid integer NOT NULL PRIMARY KEY,
+    FOREIGN KEY (srvid) REFERENCES @extschema@.powa_servers(id)
+      MATCH FULL ON UPDATE CASCADE ON DELETE CASCADE
+);
+
+/*
+ * Pending history migration jobs.  Upgrade scripts that need to convert the
+ * content of history tables register a job here rather than rewriting the
+ * tables in the ALTER EXTENSION UPDATE transaction.  The jobs are then
+ * processed in batches of blocks, each batch in its own transaction, by
+ * powa_run_migration_jobs().  nb_blocks, next_block and nb_rows show the
+ * progress of each job.  A failing job is retried later, with an increasing
+ * delay.
+ */
+CREATE TABLE @extschema@.powa_migration_jobs (
+    jobname text NOT NULL PRIMARY KEY,
+    relname text NOT NULL,
+    attname text NOT NULL,
+    convert_func text NOT NULL,
+    relfilenode oid,
+    nb_blocks bigint NOT NULL default 0,
+    next_block bigint NOT NULL default 0,
+    nb_rows bigint NOT NULL default 0,
+    registered_at timestamp with time zone NOT NULL default now(),
+    last_run timestamp with time zone,
+    finished_at timestamp with time zone,
+    nb_failures integer NOT NULL default 0,
+    retry_at timestamp with time zone,
+    last_error text
+);
+SELECT pg_catalog.pg_extension_config_dump('@extschema@.powa_migration_jobs','');
+SELECT pg_catalog.pg_extension_config_dump('@extschema@.powa_partitioned_servers','');
+
+-- powa_snapshot can only read the migration jobs
+CREATE OR REPLACE FUNCTION @extschema@.powa_grant() RETURNS void
+AS $$
+DECLARE
+    relname name;
+    relkind char;
+    powa_role name;
+    rolname name;
+    admin_role name;
+    read_all_data_role name;
+    read_all_metrics_role name;
+    write_all_data_role name;
+    snapshot_role name;
+    signal_backend_role name;
+    v_nb integer;
+BEGIN
+    FOR powa_role, rolname IN SELECT pr.powa_role, pr.rolname
+                              FROM @extschema@.powa_roles pr
+    LOOP
+        IF rolname IS NULL THEN
+            RAISE EXCEPTION 'powa_role % is NULL', powa_role;
+        END IF;
+
+        IF powa_role = 'powa_admin' THEN
+            admin_role = rolname;
+        ELSIF powa_role = 'powa_read_all_data' THEN
+            read_all_data_role = rolname;
+        ELSIF powa_role = 'powa_read_all_metrics' THEN
+            read_all_metrics_role = rolname;
+        ELSIF powa_role = 'powa_write_all_data' THEN
+            write_all_data_role = rolname;
+        ELSIF powa_role = 'powa_snapshot' THEN
+            snapshot_role = rolname;
+        ELSIF powa_role = 'powa_signal_backend' THEN
+            signal_backend_role = rolname;
+        ELSE
+            RAISE EXCEPTION 'Unexpected powa_role %', powa_role;
+        END IF;
+    END LOOP;
+
+    FOR relname, relkind IN
+        SELECT c.relname, c.relkind
+        FROM pg_depend d
+        JOIN pg_extension e ON d.refclassid = 'pg_extension'::regclass
+            AND e.oid = d.refobjid
+            AND e.extname = 'powa'
+        JOIN pg_class c ON d.classid = 'pg_class'::regclass
+            AND c.oid = d.objid
+    LOOP
+        EXECUTE format('GRANT ALL ON @extschema@.%I TO %I',
+                       relname, admin_role);
+
+        IF relkind = 'S' THEN
+            EXECUTE format('GRANT USAGE, SELECT, UPDATE ON @extschema@.%I TO %I',
+                           relname, write_all_data_role);
+        ELSE
+            EXECUTE format('GRANT SELECT, INSERT, UPDATE, DELETE, TRUNCATE '
+                           'ON @extschema@.%I TO %I',
+                           relname, write_all_data_role);
+            EXECUTE format('REVOKE REFERENCES, TRIGGER ON @extschema@.%I FROM %I',
+                           relname, write_all_data_role);
+            EXECUTE format('REVOKE REFERENCES, TRIGGER ON @extschema@.%I FROM %I',
+                           relname, snapshot_role);
+            -- powa_snapshot can only write to snapshot-related data
+            IF relname IN ('powa_roles', 'powa_servers', 'powa_extensions',
+                           'powa_extension_functions', 'powa_extension_config',
+                            'powa_modules', 'powa_module_config',
+                            'powa_module_functions', 'powa_db_modules',
+                            'powa_db_module_config',
+                            'powa_db_module_functions',
+                            'powa_db_module_src_queries', 'powa_catalogs',
+                            'powa_catalog_src_queries', 'powa_migration_jobs',
+                            'powa_query_history_config',
+                            'powa_partitioned_servers',
+                            'powa_history_index_config')
+                OR relkind = 'v'
+            THEN
+                EXECUTE format('GRANT SELECT '
+                               'ON @extschema@.%I TO %I',
+                               relname, snapshot_role);
+            ELSE
+                EXECUTE format('GRANT SELECT, INSERT, UPDATE, DELETE, TRUNCATE '
+                               'ON @extschema@.%I TO %I',
+                               relname, snapshot_role);
+            END IF;
+        END IF;
+
+        -- The migration jobs are run by the background worker, so only the
+        -- extension owner can register them.  Similarly, the partitioned
+        -- servers and the history index layout are only maintained by the
+        -- extension owner, as it owns the history tables.
+        IF relname IN ('powa_migration_jobs', 'powa_partitioned_servers',
+                       'powa_history_index_config') THEN
+            EXECUTE format('REVOKE INSERT, UPDATE, DELETE, TRUNCATE '
+                           'ON @extschema@.%I FROM %I, %I',
+                           relname, admin_role, write_all_data_role);
+        END IF;
+
+        EXECUTE format('REVOKE ALL ON @extschema@.%I FROM %I',
+                       relname, signal_backend_role);
+
+        -- powa_read_all_data only has SELECT privilege on non *_src_tmp tables
+        --
+        -- powa_read_all_metrics on has SELECT privileges on non *_src_tmp
+        -- tables and non pg_qualstats constvalues related tables
+        IF relname LIKE '%\_src\_tmp' THEN
+            EXECUTE format('REVOKE ALL ON @extschema@.%I FROM %I',
+                           relname, read_all_data_role);
+            EXECUTE format('REVOKE ALL ON @extschema@.%I FROM %I',
+                           relname, read_all_metrics_role);
+        ELSIF relname LIKE '%qualstats\_constvalues%' THEN
+            EXECUTE format('REVOKE ALL ON @extschema@.%I FROM %I',
+                           relname, read_all_metrics_role);
+            EXECUTE format('GRANT SELECT ON @extschema@.%I TO %I',
+                           relname, read_all_data_role);
+        ELSE
+            IF relkind = 'S' THEN
+                EXECUTE format('REVOKE ALL ON @extschema@.%I FROM %I',
+                               relname, read_all_data_role);
+                EXECUTE format('REVOKE ALL ON @extschema@.%I FROM %I',
+                               relname, read_all_metrics_role);
+            ELSE
+                EXECUTE format('GRANT SELECT ON @extschema@.%I TO %I',
+                               relname, read_all_data_role);
+                EXECUTE format('GRANT SELECT ON @extschema@.%I TO %I',
+                               relname, read_all_metrics_role);
+                EXECUTE format('REVOKE INSERT, UPDATE, DELETE, TRUNCATE, '
+                               'REFERENCES, TRIGGER ON @extschema@.%I FROM %I',
+                               relname, read_all_data_role);
+                EXECUTE format('REVOKE INSERT, UPDATE, DELETE, TRUNCATE, '
+                               'REFERENCES, TRIGGER ON @extschema@.%I FROM %I',
+                               relname, read_all_metrics_role);
+            END IF;
+        END IF;
+    END LOOP;
+END;
+$$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_grant() */
+
+-- and grant the ACL on the new table if the powa pseudo predefined roles are
+-- set up
+DO
+$$
+DECLARE
+    v_nb int;
+BEGIN
+    SELECT count(*) INTO v_nb
+    FROM @extschema@.powa_roles p
+    LEFT JOIN pg_catalog.pg_roles c ON c.rolname = p.rolname
+    WHERE c.rolname IS NULL;
+
+    IF v_nb = 0 THEN
+        PERFORM @extschema@.powa_grant();
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+/*
+ * Return the conversion function of the given migration job, or NULL if the
+ * job isn't valid.  As the jobs are processed by the background worker, only
+ * the columns of the extension tables, or of their partitions, can be
+ * converted, and only using an extension function taking and returning the
+ * column datatype.
+ */
+CREATE FUNCTION @extschema@.powa_migration_function(_relname text,
+    _attname text, _convert_func text)
+RETURNS regprocedure
+AS $_$
+    SELECT p.oid::regprocedure
+    FROM pg_catalog.pg_class c
+    JOIN pg_catalog.pg_attribute a ON a.attrelid = c.oid
+        AND a.attname = _attname
+        AND a.attnum > 0
+        AND NOT a.attisdropped
+    JOIN pg_catalog.pg_proc p ON p.pronamespace = c.relnamespace
+        AND p.proname = _convert_func
+        AND p.pronargs = 1
+        AND p.proargtypes[0] = a.atttypid
+        AND p.prorettype = a.atttypid
+    JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace
+    WHERE quote_ident(n.nspname) = '@extschema@'
+    AND c.relname = _relname
+    AND EXISTS (SELECT 1
+        FROM pg_catalog.pg_depend d
+        JOIN pg_catalog.pg_extension e ON d.refclassid = 'pg_catalog.pg_extension'::regclass
+            AND e.oid = d.refobjid
+            AND e.extname = 'powa'
+        WHERE d.deptype = 'e'
+        AND d.classid = 'pg_catalog.pg_proc'::regclass
+        AND d.objid = p.oid
+    )
+    AND EXISTS (SELECT 1
+        FROM pg_catalog.pg_depend d
+        JOIN pg_catalog.pg_extension e ON d.refclassid = 'pg_catalog.pg_extension'::regclass
+            AND e.oid = d.refobjid
+            AND e.extname = 'powa'
+        WHERE d.deptype = 'e'
+        AND d.classid = 'pg_catalog.pg_class'::regclass
+        AND (d.objid = c.oid
+            OR d.objid IN (SELECT i.inhparent
+                FROM pg_catalog.pg_inherits i
+                WHERE i.inhrelid = c.oid))
+    );
+$_$ LANGUAGE sql STABLE
+SET search_path = pg_catalog; /* end of powa_migration_function */
+
+/*
+ * Register a migration job for the given history table.  The job will run
+ * "UPDATE <_relname> SET <_attname> = <_convert_func>(<_attname>)" on all the
+ * rows the relation contains, a batch of blocks at a time.
+ *
+ * A job can be interrupted and resumed at any time, and is restarted from
+ * scratch if the relation is rewritten (e.g. VACUUM FULL or pg_restore), so
+ * the conversion function has to be idempotent.  Until the job is finished,
+ * the history contains both converted and unconverted values, so readers of
+ * that column have to go through powa_migration_read(), which applies the
+ * pending conversions on the fly.  This is already the case for all the
+ * history reading functions of the extension: powa_stat_get_activity(),
+ * powa_get_query_history() and the query generated by
+ * powa_export_history_query(), which is used by powa_export_history() and
+ * powa_export_history_to_file().  Any other reader, like the UI, has to do
+ * the same.  The conversions are looked up by datatype, so the coalesced
+ * records array and the *_current record column of a data source need their
+ * own job.  If the relation is partitioned, the job is split into one job per
+ * partition when it's first processed.
+ */
+CREATE FUNCTION @extschema@.powa_register_migration_job(_jobname text,
+    _relname text, _attname text, _convert_func text)
+RETURNS void
+AS $_$
+BEGIN
+    IF NOT EXISTS (SELECT 1
+                   FROM pg_catalog.pg_class c
+                   JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace
+                   WHERE quote_ident(n.nspname) = '@extschema@'
+                   AND c.relname = _relname)
+    THEN
+        RAISE EXCEPTION 'relation "%" does not exist', _relname;
+    END IF;
+
+    IF @extschema@.powa_migration_function(_relname, _attname,
+                                           _convert_func) IS NULL
+    THEN
+        RAISE EXCEPTION 'invalid migration job "%"', _jobname
+        USING DETAIL = 'Only the columns of the powa tables can be converted, using a powa function taking and returning the column datatype.';
+    END IF;
+
+    INSERT INTO @extschema@.powa_migration_jobs (jobname, relname, attname,
+        convert_func)
+    VALUES (_jobname, _relname, _attname, _convert_func);
+END;
+$_$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_register_migration_job */
+
+/*
+ * Return the conversion functions of the pending migration jobs for the
+ * given datatype, in the order they have to be applied.
+ */
+CREATE FUNCTION @extschema@.powa_migration_functions(_typid oid)
+RETURNS SETOF regprocedure
+AS $_$
+    SELECT s.convert_func
+    FROM (
+        SELECT @extschema@.powa_migration_function(j.relname, j.attname,
+            j.convert_func) AS convert_func, j.registered_at, j.jobname
+        FROM @extschema@.powa_migration_jobs j
+        WHERE j.finished_at IS NULL
+    ) s
+    JOIN pg_catalog.pg_proc p ON p.oid = s.convert_func
+    WHERE p.prorettype = _typid
+    GROUP BY s.convert_func
+    ORDER BY min(s.registered_at), min(s.jobname);
+$_$ LANGUAGE sql STABLE
+SET search_path = pg_catalog; /* end of powa_migration_functions */
+
+/*
+ * Compatibility layer for the pending migration jobs: return the given value
+ * of a history column with all the pending conversions applied, whether the
+ * underlying row was already converted or not.
+ */
+CREATE FUNCTION @extschema@.powa_migration_read(anyelement)
+    RETURNS anyelement
+    LANGUAGE c STABLE STRICT
+AS '$libdir/powa', 'powa_migration_read';
+
+/*
+ * Process a single batch of the oldest pending migration job, if any.  This
+ * should be called in a dedicated transaction, so that each batch is
+ * committed separately.  Without TID range scans, each batch would have to
+ * read the whole relation, so on PostgreSQL 13 and below the jobs are only
+ * processed if explicitly asked to with a NULL _nb_blocks, which converts all
+ * the remaining blocks at once.
+ *
+ * Return true if a batch was processed, meaning that there might still be
+ * some work left, or false if there was nothing to do.  If the batch failed,
+ * the error is saved in the job's last_error field and the job is retried
+ * later, with an exponential backoff, so that the other jobs can proceed.
+ */
+CREATE FUNCTION @extschema@.powa_run_migration_jobs(_nb_blocks integer DEFAULT 1000)
+RETURNS boolean
+AS $PROC$
+DECLARE
+    v_job record;
+    v_rel regclass;
+    v_relfilenode oid;
+    v_nb_blocks bigint;
+    v_next_block bigint;
+    v_last_block bigint;
+    v_nb_rows bigint = 0;
+BEGIN
+    IF (_nb_blocks < 1) THEN
+        RAISE EXCEPTION 'the number of blocks should be at least 1';
+    END IF;
+
+    IF (_nb_blocks IS NOT NULL
+        AND current_setting('server_version_num')::int < 140000)
+    THEN
+        PERFORM @extschema@.powa_log('migration jobs can only be processed in batches on PostgreSQL 14 or later');
+        RETURN false;
+    END IF;
+
+    -- Don't block if another backend is already processing a job
+    SELECT * INTO v_job
+    FROM @extschema@.powa_migration_jobs
+    WHERE finished_at IS NULL
+    AND (retry_at IS NULL OR retry_at <= now())
+    ORDER BY registered_at, jobname
+    LIMIT 1
+    FOR UPDATE SKIP LOCKED;
+
+    IF NOT FOUND THEN
+        RETURN false;
+    END IF;
+
+    SELECT c.oid INTO v_rel
+    FROM pg_catalog.pg_class c
+    JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace
+    WHERE quote_ident(n.nspname) = '@extschema@'
+    AND c.relname = v_job.relname;
+
+    -- The relation was dropped, nothing left to convert
+    IF v_rel IS NULL THEN
+        UPDATE @extschema@.powa_migration_jobs
+        SET last_run = now(), finished_at = now()
+        WHERE jobname = v_job.jobname;
+
+        RETURN true;
+    END IF;
+
+    -- Never run anything that wasn't registered by the extension
+    IF @extschema@.powa_migration_function(v_job.relname, v_job.attname,
+                                           v_job.convert_func) IS NULL
+    THEN
+        UPDATE @extschema@.powa_migration_jobs
+        SET last_run = now(), retry_at = 'infinity',
+            last_error = 'invalid migration job'
+        WHERE jobname = v_job.jobname;
+
+        RETURN true;
+    END IF;
+
+    -- The rows of a partitioned table are stored in its partitions, so replace
+    -- the job with one job per partition.  This can happen if the job was
+    -- registered before the history tables were partitioned by server.
+    IF EXISTS (SELECT 1 FROM pg_catalog.pg_class
+               WHERE oid = v_rel AND relkind = 'p')
+    THEN
+        INSERT INTO @extschema@.powa_migration_jobs (jobname, relname,
+            attname, convert_func, registered_at)
+        SELECT format('%s (%s)', v_job.jobname, c.relname), c.relname,
+            v_job.attname, v_job.convert_func, v_job.registered_at
+        FROM pg_catalog.pg_inherits i
+        JOIN pg_catalog.pg_class c ON c.oid = i.inhrelid
+        WHERE i.inhparent = v_rel
+        ON CONFLICT (jobname) DO NOTHING;
+
+        UPDATE @extschema@.powa_migration_jobs
+        SET last_run = now(), finished_at = now()
+        WHERE jobname = v_job.jobname;
+
+        RETURN true;
+    END IF;
+
+    v_relfilenode := pg_catalog.pg_relation_filenode(v_rel);
+    v_nb_blocks := v_job.nb_blocks;
+    v_next_block := v_job.next_block;
+
+    -- First batch, or the relation was rewritten since the last batch, so
+    -- start from the beginning.  Only the blocks existing at that time need to
+    -- be processed, as any row inserted or updated later is stored in the new
+    -- format.
+    IF v_job.relfilenode IS DISTINCT FROM v_relfilenode THEN
+        v_nb_blocks := pg_catalog.pg_relation_size(v_rel)
+            / current_setting('block_size')::bigint;
+        v_next_block := 0;
+    END IF;
+
+    IF _nb_blocks IS NULL THEN
+        v_last_block := v_nb_blocks;
+    ELSE
+        v_last_block := least(v_next_block + _nb_blocks, v_nb_blocks);
+    END IF;
+
+    PERFORM @extschema@.powa_log(format('running migration job "%s" on %s, blocks %s to %s of %s',
+        v_job.jobname, v_job.relname, v_next_block, v_last_block, v_nb_blocks));
+
+    IF v_next_block < v_last_block THEN
+        BEGIN
+            EXECUTE format('UPDATE @extschema@.%I SET %I = @extschema@.%I(%I)'
+                           ' WHERE ctid >= $1 AND ctid < $2',
+                v_job.relname, v_job.attname, v_job.convert_func,
+                v_job.attname)
+            USING format('(%s,0)', v_next_block)::tid,
+                format('(%s,0)', v_last_block)::tid;
+
+            GET DIAGNOSTICS v_nb_rows = ROW_COUNT;
+        EXCEPTION
+          WHEN OTHERS THEN
+            UPDATE @extschema@.powa_migration_jobs
+            SET last_run = now(), last_error = SQLERRM,
+                nb_failures = nb_failures + 1,
+                retry_at = now() + interval '1 minute'
+                    * power(2, least(nb_failures, 10))
+            WHERE jobname = v_job.jobname;
+
+            RETURN true;
+        END;
+    END IF;
+
+    UPDATE @extschema@.powa_migration_jobs
+    SET relfilenode = v_relfilenode,
+        nb_blocks = v_nb_blocks,
+        next_block = v_last_block,
+        nb_rows = CASE WHEN v_next_block = 0 THEN 0 ELSE nb_rows END + v_nb_rows,
+        last_run = now(),
+        finished_at = CASE WHEN v_last_block >= v_nb_blocks THEN now() END,
+        nb_failures = 0,
+        retry_at = NULL,
+        last_error = NULL
+    WHERE jobname = v_job.jobname;
+
+    RETURN true;
+END;
+$PROC$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_run_migration_jobs */
+
+/*
+ * Return the partitions of the history tables that belong to the given
+ * server, if the history tables are partitioned by server (see
+ * powa_setup_server_partitioning()).  Partitions are named
+ * <parent>_srv<srvid>.
+ */
+CREATE FUNCTION @extschema@.powa_server_partitions(_srvid integer)
+RETURNS SETOF regclass AS $_$
+    SELECT c.oid::regclass
+    FROM pg_catalog.pg_depend d
+    JOIN pg_catalog.pg_extension e ON d.refclassid = 'pg_catalog.pg_extension'::regclass
+        AND e.oid = d.refobjid
+        AND e.extname = 'powa'
+    JOIN pg_catalog.pg_class p ON d.classid = 'pg_catalog.pg_class'::regclass
+        AND p.oid = d.objid
+    JOIN pg_catalog.pg_inherits i ON i.inhparent = p.oid
+    JOIN pg_catalog.pg_class c ON c.oid = i.inhrelid
+    WHERE p.relkind = 'p'
+    AND c.relname = p.relname || '_srv' || _srvid
+    ORDER BY p.relname;
+$_$ LANGUAGE sql
+SET search_path = pg_catalog; /* end of powa_server_partitions */
+
+/*
+ * Create the missing partitions for the given server on all the history
+ * tables that are partitioned by server.  This is a no-op if the history
+ * tables aren't partitioned.
+ *
+ * The partitions of the remote servers are regular tables, not part of the
+ * extension, so pg_dump dumps them as any other table, with their data, and
+ * pg_restore recreates them before restoring the powa_servers data.  As
+ * attaching them to their parent creates their indexes, pg_restore will
+ * report that those indexes and primary keys already exist, which is
+ * harmless.  Only the local server partitions, which are created by the
+ * extension scripts and thus also by CREATE EXTENSION on restore, are part of
+ * the extension.
+ */
+CREATE FUNCTION @extschema@.powa_create_server_partitions(_srvid integer)
+RETURNS void AS $_$
+DECLARE
+    v_rec record;
+    v_part text;
+    v_acl record;
+BEGIN
+    FOR v_rec IN
+        SELECT p.oid, p.relname,
+            EXISTS (SELECT 1 FROM pg_catalog.pg_attribute a
+                WHERE a.attrelid = p.oid
+                AND a.attname = 'mins_in_range') AS coalesced
+        FROM pg_catalog.pg_depend d
+        JOIN pg_catalog.pg_extension e ON d.refclassid = 'pg_catalog.pg_extension'::regclass
+            AND e.oid = d.refobjid
+            AND e.extname = 'powa'
+        JOIN pg_catalog.pg_class p ON d.classid = 'pg_catalog.pg_class'::regclass
+            AND p.oid = d.objid
+        WHERE p.relkind = 'p'
+        AND pg_catalog.to_regclass(format('@extschema@.%I',
+            p.relname || '_srv' || _srvid)) IS NULL
+        ORDER BY p.relname
+    LOOP
+        v_part := format('@extschema@.%I', v_rec.relname || '_srv' || _srvid);
+
+        -- partitions of coalesced tables need the same aggressive toasting as
+        -- the plain tables, see powa_fix_toast_tuple_target()
+        EXECUTE format('CREATE TABLE %s PARTITION OF @extschema@.%I FOR VALUES IN (%s)%s',
+            v_part, v_rec.relname, _srvid,
+            CASE WHEN v_rec.coalesced THEN ' WITH (toast_tuple_target = 128)'
+                ELSE ''
+            END);
+
+        -- tables created by the extension scripts are automatically part of
+        -- the extension
+        IF EXISTS (SELECT 1
+            FROM pg_catalog.pg_depend d
+            WHERE d.classid = 'pg_catalog.pg_class'::regclass
+            AND d.objid = v_part::regclass
+            AND d.deptype = 'e')
+        THEN
+            IF _srvid = 0 THEN
+                PERFORM pg_catalog.pg_extension_config_dump(v_part, '');
+            ELSE
+                EXECUTE format('ALTER EXTENSION powa DROP TABLE %s', v_part);
+            END IF;
+        END IF;
+
+        -- give the powa roles the same privileges as on the partitioned table
+        FOR v_acl IN
+            SELECT a.privilege_type, a.grantee
+            FROM pg_catalog.pg_class c,
+                pg_catalog.aclexplode(c.relacl) a
+            WHERE c.oid = v_rec.oid
+            AND a.grantee <> c.relowner
+        LOOP
+            EXECUTE format('GRANT %s ON %s TO %s',
+                v_acl.privilege_type, v_part,
+                CASE WHEN v_acl.grantee = 0 THEN 'PUBLIC'
+                    ELSE quote_ident(pg_catalog.pg_get_userbyid(v_acl.grantee))
+                END);
+        END LOOP;
+    END LOOP;
+END;
+$_$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_create_server_partitions */
+
+/*
+ * Trigger on powa_partitioned_servers creating the partitions of the
+ * inserted server, after partitioning the history tables if the local server
+ * is inserted.  Rows that already exist are ignored, as pg_restore restores
+ * rows that were already inserted by CREATE EXTENSION or by the powa_servers
+ * trigger.
+ */
+CREATE FUNCTION @extschema@.powa_partitioned_servers_trigger()
+RETURNS trigger AS $_$
+BEGIN
+    IF TG_WHEN = 'BEFORE' THEN
+        IF EXISTS (SELECT 1 FROM @extschema@.powa_partitioned_servers
+                   WHERE srvid = NEW.srvid)
+        THEN
+            RETURN NULL;
+        END IF;
+
+        RETURN NEW;
+    END IF;
+
+    IF NEW.srvid = 0 THEN
+        PERFORM @extschema@.powa_setup_server_partitioning();
+    ELSE
+        PERFORM @extschema@.powa_create_server_partitions(NEW.srvid);
+    END IF;
+
+    RETURN NULL;
+END;
+$_$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_partitioned_servers_trigger */
+
+/*
+ * Trigger on powa_servers creating the partitions of a newly registered
+ * server, and dropping the partitions of a deleted server, which is way
+ * cheaper than cascading the deletion to all the rows, if the history tables
+ * are partitioned by server.
+ *
+ * This has to be usable by the powa_admin role, which doesn't own the history
+ * tables nor the extension, so it runs with the privileges of the extension
+ * owner.  It can only create or drop the partitions of the server being
+ * inserted or deleted.
+ */
+CREATE FUNCTION @extschema@.powa_servers_partitions_trigger()
+RETURNS trigger AS $_$
+DECLARE
+    v_part regclass;
+BEGIN
+    IF TG_OP = 'INSERT' THEN
+        INSERT INTO @extschema@.powa_partitioned_servers (srvid)
+        SELECT NEW.id
+        WHERE EXISTS (SELECT 1 FROM @extschema@.powa_partitioned_servers
+                      WHERE srvid = 0)
+        ON CONFLICT (srvid) DO NOTHING;
+
+        RETURN NULL;
+    END IF;
+
+    FOR v_part IN SELECT * FROM @extschema@.powa_server_partitions(OLD.id)
+    LOOP
+        EXECUTE format('DROP TABLE %s', v_part);
+    END LOOP;
+
+    RETURN OLD;
+END;
+$_$ LANGUAGE plpgsql SECURITY DEFINER
+SET search_path = pg_catalog; /* end of powa_servers_partitions_trigger */
+
+CREATE OR REPLACE FUNCTION @extschema@.powa_reset(_srvid integer)
+ RETURNS boolean
+ LANGUAGE plpgsql
+AS $function$
+DECLARE
+  r         record;
+  v_state   text;
+  v_msg     text;
+  v_detail  text;
+  v_hint    text;
+  v_context text;
+  v_parts   text;
+BEGIN
+    -- If the history tables are partitioned by server, empty all the server
+    -- partitions at once rather than deleting all the rows
+    SELECT string_agg(p::text, ', ') INTO v_parts
+    FROM @extschema@.powa_server_partitions(_srvid) p;
+
+    IF v_parts IS NOT NULL THEN
+        EXECUTE format('TRUNCATE %s', v_parts);
+    END IF;
+
+    -- Find reset function for every supported datasource, including pgss
+    FOR r IN SELECT CASE external
+                WHEN true THEN quote_ident(nsp.nspname)
+                ELSE '@extschema@'
+            END AS schema, function_name AS funcname
+            FROM @extschema@.powa_all_functions AS pf
+            LEFT JOIN pg_extension AS ext ON pf.kind = 'extension'
+               AND ext.extname = pf.name
+            LEFT JOIN pg_namespace AS nsp ON nsp.oid = ext.extnamespace
+            WHERE operation='reset'
+            AND srvid = _srvid
+            ORDER BY priority, name LOOP
+      -- Call all of them, for the current srvid
+      BEGIN
+          EXECUTE format('SELECT %s.%I(%s)', r.schema, r.funcname, _srvid);
+      EXCEPTION
+        WHEN OTHERS THEN
+          GET STACKED DIAGNOSTICS
+              v_state   = RETURNED_SQLSTATE,
+              v_msg     = MESSAGE_TEXT,
+              v_detail  = PG_EXCEPTION_DETAIL,
+              v_hint    = PG_EXCEPTION_HINT,
+              v_context = PG_EXCEPTION_CONTEXT;
+          RAISE warning 'powa_reset(): function "%.%(%)" failed:
+              state  : %
+              message: %
+              detail : %
+              hint   : %
+              context: %',
+              r.schema, quote_ident(r.funcname), _srvid, v_state, v_msg,
+              v_detail, v_hint, v_context;
+
+      END;
+    END LOOP;
+
+    -- And reset all catalogs
+    BEGIN
+      PERFORM @extschema@.powa_catalog_reset(_srvid);
+    EXCEPTION
+      WHEN OTHERS THEN
+        GET STACKED DIAGNOSTICS
+            v_state   = RETURNED_SQLSTATE,
+            v_msg     = MESSAGE_TEXT,
+            v_detail  = PG_EXCEPTION_DETAIL,
+            v_hint    = PG_EXCEPTION_HINT,
+            v_context = PG_EXCEPTION_CONTEXT;
+        RAISE warning 'powa_reset(): function "@extschema@.powa_catalog_reset(%)" failed:
+            state  : %
+            message: %
+            detail : %
+            hint   : %
+            context: %',
+            _srvid, v_state, v_msg, v_detail, v_hint, v_context;
+    END;
+
+    RETURN true;
+END;
+$function$
+SET search_path = pg_catalog; /* end of powa_reset */
+
+CREATE OR REPLACE FUNCTION @extschema@.powa_fix_toast_tuple_target() RETURNS void
+LANGUAGE plpgsql AS
+$$
+DECLARE curr_table regclass;
+BEGIN
+  IF current_setting('server_version_num')::int >= 110000 THEN
+
+    FOR curr_table IN
+        WITH ext AS (
+            SELECT c.oid, c.relname, c.reloptions
+            FROM pg_depend d
+            JOIN pg_extension e ON d.refclassid = 'pg_extension'::regclass
+                AND e.oid = d.refobjid
+                AND e.extname = 'powa'
+            JOIN pg_class c ON d.classid = 'pg_class'::regclass
+                AND c.oid = d.objid
+            -- partitioned tables can't have storage parameters, their
+            -- partitions are created with the right toast_tuple_target
+            WHERE c.relkind NOT IN ('v', 'p')
+        )
+        SELECT ext.oid::regclass::text
+        FROM ext
+        WHERE EXISTS
+          (SELECT 1 FROM pg_attribute a
+           WHERE a.attrelid = ext.oid
+              AND a.attname = 'mins_in_range'
+          )
+        AND 'toast_tuple_target=128' <> ALL(coalesce(ext.reloptions,'{}'))
+    LOOP
+      EXECUTE 'ALTER TABLE ' || curr_table::text || ' SET (TOAST_TUPLE_TARGET=128)';
+    END LOOP;
+  END IF;
+END
+$$; /* end of powa_fix_toast_tuple_target */
+
+/*
+ * Convert the per-server history tables to tables list-partitioned on srvid,
+ * if the history tables are partitioned by server, i.e. if the local server is
+ * in powa_partitioned_servers.  This is called when the local server is added
+ * to that table, and at the end of the extension scripts so that any newly
+ * added history table gets the same layout as the rest.
+ *
+ * With this layout, removing a server or resetting its data only has to drop
+ * or truncate its partitions, and the per-server snapshot, aggregate and purge
+ * queries and vacuum only have to process the partitions of that server.
+ *
+ * The catalog and source tables are left alone, as they're small, and some of
+ * them are referenced by foreign keys.
+ *
+ * The layout can only be chosen by the extension scripts, with the
+ * powa.partition_by_server parameter, and only empty tables are converted:
+ * moving the existing history would rewrite all of it in a single transaction
+ * while holding an ACCESS EXCLUSIVE lock on each table.  For the same reason,
+ * a dump of partitioned history tables has to be restored in a database where
+ * the extension was created with powa.partition_by_server enabled.
+ */
+CREATE FUNCTION @extschema@.powa_setup_server_partitioning() RETURNS void
+AS $_$
+DECLARE
+    v_converted boolean = false;
+    v_rec record;
+    v_defs text[];
+    v_def text;
+    v_nb int;
+    v_empty boolean;
+BEGIN
+    IF NOT EXISTS (SELECT 1 FROM @extschema@.powa_partitioned_servers
+                   WHERE srvid = 0)
+    THEN
+        RETURN;
+    END IF;
+
+    IF current_setting('server_version_num')::int < 110000 THEN
+        RAISE EXCEPTION 'powa.partition_by_server requires PostgreSQL 11 or later';
+    END IF;
+
+    -- all the servers get their own partitions
+    INSERT INTO @extschema@.powa_partitioned_servers (srvid)
+    SELECT id FROM @extschema@.powa_servers
+    ORDER BY id
+    ON CONFLICT (srvid) DO NOTHING;
+
+    FOR v_rec IN
+        SELECT c.oid, c.relname
+        FROM pg_catalog.pg_depend d
+        JOIN pg_catalog.pg_extension e ON d.refclassid = 'pg_catalog.pg_extension'::regclass
+            AND e.oid = d.refobjid
+            AND e.extname = 'powa'
+        JOIN pg_catalog.pg_class c ON d.classid = 'pg_catalog.pg_class'::regclass
+            AND c.oid = d.objid
+        WHERE c.relkind = 'r'
+        AND c.relpersistence = 'p'
+        AND NOT c.relispartition
+        AND (c.relname ~ '_history(_db)?(_current(_db)?)?$'
+            OR c.relname LIKE 'powa\_kcache\_metrics%')
+        AND EXISTS (SELECT 1 FROM pg_catalog.pg_attribute a
+            WHERE a.attrelid = c.oid
+            AND a.attname = 'srvid')
+        ORDER BY c.relname
+    LOOP
+        EXECUTE format('SELECT NOT EXISTS (SELECT 1 FROM @extschema@.%I)',
+            v_rec.relname) INTO v_empty;
+
+        IF NOT v_empty THEN
+            RAISE EXCEPTION 'cannot partition history table "%" by server as it is not empty',
+                v_rec.relname;
+        END IF;
+
+        -- Remember the constraints and indexes, they will be recreated with
+        -- the same names on the new table.
+        SELECT array_agg(def ORDER BY kind, name) INTO v_defs
+        FROM (
+            SELECT 1 AS kind, conname AS name,
+                format('ALTER TABLE @extschema@.%I ADD CONSTRAINT %I %s',
+                    v_rec.relname, conname,
+                    pg_catalog.pg_get_constraintdef(oid)) AS def
+            FROM pg_catalog.pg_constraint
+            WHERE conrelid = v_rec.oid
+            AND contype IN ('p', 'u', 'f')
+            UNION ALL
+            SELECT 2, c.relname, pg_catalog.pg_get_indexdef(i.indexrelid)
+            FROM pg_catalog.pg_index i
+            JOIN pg_catalog.pg_class c ON c.oid = i.indexrelid
+            WHERE i.indrelid = v_rec.oid
+            AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_constraint con
+                WHERE con.conrelid = v_rec.oid
+                AND con.conindid = i.indexrelid)
+        ) s;
+
+        EXECUTE format('ALTER TABLE @extschema@.%I RENAME TO powa_partition_tmp',
+            v_rec.relname);
+        EXECUTE format('CREATE TABLE @extschema@.%I (LIKE @extschema@.powa_partition_tmp INCLUDING DEFAULTS INCLUDING CONSTRAINTS INCLUDING STORAGE) PARTITION BY LIST (srvid)',
+            v_rec.relname);
+
+        -- the new table is only automatically part of the extension when
+        -- created by the extension scripts
+        IF NOT EXISTS (SELECT 1
+            FROM pg_catalog.pg_depend d
+            WHERE d.classid = 'pg_catalog.pg_class'::regclass
+            AND d.objid = format('@extschema@.%I', v_rec.relname)::regclass
+            AND d.deptype = 'e')
+        THEN
+            RAISE EXCEPTION 'the history tables can only be partitioned by server when creating or updating the extension';
+        END IF;
+
+        PERFORM @extschema@.powa_create_server_partitions(srvid)
+        FROM @extschema@.powa_partitioned_servers
+        ORDER BY srvid;
+
+        -- make sure the old table is removed from the extension configuration
+        -- tables before dropping it
+        ALTER EXTENSION powa DROP TABLE @extschema@.powa_partition_tmp;
+        DROP TABLE @extschema@.powa_partition_tmp;
+
+        FOREACH v_def IN ARRAY coalesce(v_defs, '{}') LOOP
+            EXECUTE v_def;
+        END LOOP;
+
+        v_converted := true;
+    END LOOP;
+
+    IF NOT v_converted THEN
+        RETURN;
+    END IF;
+
+    -- grant the ACL on the new tables if the powa pseudo predefined roles are
+    -- set up
+    SELECT count(*) INTO v_nb
+    FROM @extschema@.powa_roles p
+    LEFT JOIN pg_catalog.pg_roles c ON c.rolname = p.rolname
+    WHERE c.rolname IS NULL;
+
+    IF v_nb = 0 THEN
+        PERFORM @extschema@.powa_grant();
+    END IF;
+END;
+$_$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_setup_server_partitioning */
+
+CREATE OR REPLACE FUNCTION @extschema@.powa_stat_get_activity(
+    _srvid integer,
+    _from timestamp with time zone,
+    _to timestamp with time zone
+)
+RETURNS SETOF @extschema@.powa_stat_activity_history_record
+AS
+$$
+BEGIN
+    -- apply the pending migration jobs conversions, if any
+    RETURN QUERY
+        SELECT r.*
+        FROM @extschema@.powa_stat_activity_history_current h,
+        LATERAL @extschema@.powa_migration_read(h.record) r
+        WHERE h.srvid = _srvid
+        AND (h.record).ts >= _from
+        AND (h.record).ts <= _to
+        UNION ALL
+        SELECT r.*
+        FROM @extschema@.powa_stat_activity_history h,
+        LATERAL unnest(@extschema@.powa_migration_read(h.records)) r
+        WHERE h.srvid = _srvid
+        AND h.coalesce_range && tstzrange(_from, _to, '[]')
+        -- redundant, but usable by the btree history index layout
+        AND upper(h.coalesce_range) >= _from
+        AND r.ts >= _from
+        AND r.ts <= _to;
+END;
+$$
+LANGUAGE plpgsql; /* end of powa_stat_get_activity */
+
+/*
+ * Switch the history tables to the btree index layout, if powa.history_index
+ * is set to btree or if that layout is already recorded in
+ * powa_history_index_config.  This is called at the end of the extension
+ * scripts so that any newly added history table gets the same layout as the
+ * rest.
+ *
+ * The coalesced records of a server are always inserted in time order and
+ * purged from the oldest end, so instead of GiST indexes on (srvid, <key>,
+ * coalesce_range), which are expensive to maintain and bloat under purge,
+ * this layout uses btree indexes on (srvid, <key>, upper(coalesce_range)).
+ * The read functions add a redundant upper(coalesce_range) clause to their
+ * range overlap test so that those indexes can be used.
+ *
+ * Only the indexes that are a plain list of columns are rewritten, anything
+ * else (expressions, predicates or INCLUDE columns) is kept as-is.
+ */
+CREATE FUNCTION @extschema@.powa_setup_history_indexes() RETURNS void
+AS $_$
+DECLARE
+    v_mode text;
+    v_rec record;
+    v_idx record;
+BEGIN
+    v_mode := @extschema@.powa_get_guc('powa.history_index', 'gist');
+
+    IF v_mode NOT IN ('gist', 'btree') THEN
+        RAISE EXCEPTION 'invalid value for powa.history_index: "%"', v_mode;
+    END IF;
+
+    -- once chosen, the btree layout is kept for the new tables
+    IF v_mode = 'btree' THEN
+        UPDATE @extschema@.powa_history_index_config SET method = 'btree';
+    END IF;
+
+    SELECT method INTO v_mode FROM @extschema@.powa_history_index_config;
+
+    IF v_mode = 'gist' THEN
+        RETURN;
+    END IF;
+
+    -- partitions get their indexes from their parent
+    FOR v_rec IN
+        SELECT c.oid, c.relname
+        FROM pg_catalog.pg_depend d
+        JOIN pg_catalog.pg_extension e ON d.refclassid = 'pg_catalog.pg_extension'::regclass
+            AND e.oid = d.refobjid
+            AND e.extname = 'powa'
+        JOIN pg_catalog.pg_class c ON d.classid = 'pg_catalog.pg_class'::regclass
+            AND c.oid = d.objid
+        WHERE c.relkind IN ('r', 'p')
+        AND EXISTS (SELECT 1 FROM pg_catalog.pg_attribute a
+            WHERE a.attrelid = c.oid
+            AND a.attname = 'coalesce_range')
+        AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_inherits inh
+            WHERE inh.inhrelid = c.oid)
+        ORDER BY c.relname
+    LOOP
+        -- Replace the non-btree indexes on coalesce_range, keeping the same
+        -- names.  The constraints indexes are left alone.
+        FOR v_idx IN
+            SELECT ic.relname,
+                -- indclass only covers the key columns
+                bool_and(i.indexprs IS NULL AND i.indpred IS NULL
+                    AND i.indnatts = array_length(i.indclass::oid[], 1)) AS plain,
+                string_agg(CASE WHEN a.attname = 'coalesce_range'
+                        THEN 'upper(coalesce_range)'
+                        ELSE quote_ident(a.attname)
+                    END, ', ' ORDER BY k.pos) AS cols
+            FROM pg_catalog.pg_index i
+            JOIN pg_catalog.pg_class ic ON ic.oid = i.indexrelid
+            JOIN pg_catalog.pg_am am ON am.oid = ic.relam
+            CROSS JOIN LATERAL unnest(i.indkey::int2[]) WITH ORDINALITY k(attnum, pos)
+            JOIN pg_catalog.pg_attribute a ON a.attrelid = i.indrelid
+                AND a.attnum = k.attnum
+            WHERE i.indrelid = v_rec.oid
+            AND am.amname <> 'btree'
+            AND NOT EXISTS (SELECT 1 FROM pg_catalog.pg_constraint con
+                WHERE con.conrelid = v_rec.oid
+                AND con.conindid = i.indexrelid)
+            GROUP BY ic.relname
+            HAVING bool_or(a.attname = 'coalesce_range')
+            ORDER BY ic.relname
+        LOOP
+            IF NOT v_idx.plain THEN
+                RAISE WARNING 'index "%" is not a plain list of columns, keeping it unchanged',
+                    v_idx.relname;
+                CONTINUE;
+            END IF;
+
+            EXECUTE format('DROP INDEX @extschema@.%I', v_idx.relname);
+            EXECUTE format('CREATE INDEX %I ON @extschema@.%I USING btree (%s)',
+                v_idx.relname, v_rec.relname, v_idx.cols);
+        END LOOP;
+    END LOOP;
+END;
+$_$ LANGUAGE plpgsql
+SET search_path = pg_catalog; /* end of powa_setup_history_indexes */
+
 ---------------------------------------
 -- cleanup data sources generic support
 ---------------------------------------
 DROP FUNCTION @extschema@.powa_generic_datatype_setup(text, text[], jsonb, boolean);
 DROP FUNCTION @extschema@.powa_generic_module_setup(text, text[], text[], boolean, text[], boolean, integer);
 
+-- switch the history tables to the btree index layout if asked to
+SELECT @extschema@.powa_setup_history_indexes();
+
+CREATE TRIGGER powa_partitioned_servers_ins_check
+    BEFORE INSERT ON @extschema@.powa_partitioned_servers
+    FOR EACH ROW EXECUTE PROCEDURE @extschema@.powa_partitioned_servers_trigger();
+CREATE TRIGGER powa_partitioned_servers_ins
+    AFTER INSERT ON @extschema@.powa_partitioned_servers
+    FOR EACH ROW EXECUTE PROCEDURE @extschema@.powa_partitioned_servers_trigger();
+CREATE TRIGGER powa_servers_partitions_ins
+    AFTER INSERT ON @extschema@.powa_servers
+    FOR EACH ROW EXECUTE PROCEDURE @extschema@.powa_servers_partitions_trigger();
+CREATE TRIGGER powa_servers_partitions_del
+    BEFORE DELETE ON @extschema@.powa_servers
+    FOR EACH ROW EXECUTE PROCEDURE @extschema@.powa_servers_partitions_trigger();
+
+-- partition the history tables by server if asked to
+INSERT INTO @extschema@.powa_partitioned_servers (srvid)
+SELECT 0
+WHERE @extschema@.powa_get_guc('powa.partition_by_server', 'off')::boolean
+ON CONFLICT (srvid) DO NOTHING;
+SELECT @extschema@.powa_setup_server_partitioning();
+
 -- Fix the toast tuple targets
 SELECT @extschema@.powa_fix_toast_tuple_target();
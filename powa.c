@@ -43,6 +43,9 @@
 /* There is a GUC */
 #include "utils/guc.h"
 
+/* For the migration jobs compatibility layer */
+#include "utils/lsyscache.h"
+
 /* We use tuplestore */
 #include "funcapi.h"
 #include "utils/tuplestore.h"
@@ -71,18 +74,51 @@ typedef enum
 	POWA_STAT_TABLE
 }	PowaStatKind;
 
+/* Index layout of the history tables, see powa_setup_history_indexes() */
+typedef enum
+{
+	POWA_HISTORY_INDEX_GIST,
+	POWA_HISTORY_INDEX_BTREE
+}	PowaHistoryIndex;
+
+static const struct config_enum_entry powa_history_index_options[] = {
+	{"gist", POWA_HISTORY_INDEX_GIST, false},
+	{"btree", POWA_HISTORY_INDEX_BTREE, false},
+	{NULL, 0, false}
+};
+
 void			_PG_init(void);
 static bool		powa_check_frequency_hook(int *newval, void **extra, GucSource source);
 static void		compute_powa_frequency(void);
 static int64	compute_next_wakeup(void);
-static void		powa_get_snapshot_query(StringInfo query);
+static void		powa_get_snapshot_query(StringInfo query,
+										StringInfo query_migration,
+										StringInfo query_migration_check);
+static void		powa_run_migration_jobs(const char *query_migration,
+										const char *query_migration_check);
 
 Datum		powa_stat_user_functions(PG_FUNCTION_ARGS);
 Datum		powa_stat_all_rel(PG_FUNCTION_ARGS);
 static Datum powa_stat_common(PG_FUNCTION_ARGS, PowaStatKind kind);
+Datum		powa_migration_read(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(powa_stat_user_functions);
 PG_FUNCTION_INFO_V1(powa_stat_all_rel);
+PG_FUNCTION_INFO_V1(powa_migration_read);
+
+/*
+ * Conversion functions of the pending migration jobs for a given datatype,
+ * cached in fn_extra for the duration of the query.
+ */
+typedef struct PowaMigrationCache
+{
+	Oid			typid;
+	int			nfuncs;
+	FmgrInfo   *funcs;
+} PowaMigrationCache;
+
+static PowaMigrationCache *powa_migration_get_cache(FunctionCallInfo fcinfo,
+													 Oid typid);
 
 #if (PG_VERSION_NUM >= 180000)
 pg_noreturn PGDLLEXPORT void powa_main(Datum main_arg);
@@ -105,6 +141,8 @@ static int			powa_coalesce;			 	/* powa.coalesce GUC */
 static char		   *powa_database = NULL;	 	/* powa.database GUC */
 static char 	   *powa_ignored_users = NULL;	/* powa.ignored_users GUC */
 static bool			powa_debug = false;			/* powa.debug GUC */
+static bool			powa_partition_by_server = false;	/* powa.partition_by_server GUC */
+static int			powa_history_index = POWA_HISTORY_INDEX_GIST;	/* powa.history_index GUC */
 
 /* flags set by signal handlers */
 static volatile sig_atomic_t got_sighup = false;
@@ -173,11 +211,13 @@ compute_next_wakeup(void)
 }
 
 /*
- * Generate the needed statement to perform a local snapshot.
- * The only needed dynamic part is the powa schema to qualify the function.
+ * Generate the needed statements to perform a local snapshot and to process
+ * the pending history migration jobs.
+ * The only needed dynamic part is the powa schema to qualify the functions.
  */
 static void
-powa_get_snapshot_query(StringInfo query)
+powa_get_snapshot_query(StringInfo query, StringInfo query_migration,
+						StringInfo query_migration_check)
 {
 	char	   *nsp = NULL;
 	int			ret;
@@ -227,9 +267,96 @@ powa_get_snapshot_query(StringInfo query)
 	initStringInfo(query);
 	appendStringInfoString(query, "SET search_path TO pg_catalog;");
 	appendStringInfo(query, "SELECT %s.powa_take_snapshot()", nsp);
+
+	initStringInfo(query_migration);
+	appendStringInfo(query_migration, "SELECT %s.powa_run_migration_jobs()",
+					 nsp);
+
+	initStringInfo(query_migration_check);
+	appendStringInfo(query_migration_check,
+					 "SELECT pg_catalog.to_regproc(%s) IS NOT NULL",
+					 quote_literal_cstr(psprintf("%s.powa_run_migration_jobs",
+												 nsp)));
 	pfree(nsp);
 }
 
+/*
+ * Process the pending history migration jobs, if any.  Each batch is run in
+ * its own transaction, and we stop as soon as there's nothing left to do or
+ * half of the time until the next snapshot has been consumed, so that the
+ * migration doesn't delay the snapshots nor hog the server.
+ *
+ * The function may not exist yet if the library has been updated but not the
+ * extension, so check for it first.
+ */
+static void
+powa_run_migration_jobs(const char *query_migration,
+						const char *query_migration_check)
+{
+	bool		more = true;
+
+	while (more)
+	{
+		/* Check if a SIGHUP has been received */
+		powa_process_sighup();
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (powa_frequency == -1 || force_snapshot ||
+			compute_next_wakeup() < (int64) powa_frequency * 1000 / 2)
+			break;
+
+		set_ps_display("migration"
+#if PG_VERSION_NUM < 130000
+			, false
+#endif
+			);
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+
+		more = false;
+		if (SPI_execute(query_migration_check, true, 1) == SPI_OK_SELECT &&
+			SPI_processed == 1)
+		{
+			bool		isnull;
+			Datum		val;
+
+			val = SPI_getbinval(SPI_tuptable->vals[0],
+								SPI_tuptable->tupdesc, 1, &isnull);
+			more = (!isnull && DatumGetBool(val));
+		}
+
+		if (more)
+		{
+			pgstat_report_activity(STATE_RUNNING, query_migration);
+			more = false;
+			if (SPI_execute(query_migration, false, 1) == SPI_OK_SELECT &&
+				SPI_processed == 1)
+			{
+				bool		isnull;
+				Datum		val;
+
+				val = SPI_getbinval(SPI_tuptable->vals[0],
+									SPI_tuptable->tupdesc, 1, &isnull);
+				more = (!isnull && DatumGetBool(val));
+			}
+		}
+
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		pgstat_report_stat(false);
+		pgstat_report_activity(STATE_IDLE, NULL);
+		set_ps_display("idle"
+#if PG_VERSION_NUM < 130000
+			, false
+#endif
+			);
+	}
+}
+
 /*
  * As of powa 4, this extension can be with a remote snapshot daemon instead of
  * the dedicated background worker.  In order to allow this daemon to use the
@@ -289,6 +416,24 @@ _PG_init(void)
 							INT_MAX / SECS_PER_MINUTE,
 							PGC_SUSET, GUC_UNIT_MIN, NULL, NULL, NULL);
 
+	/*
+	 * Those are only read by the extension scripts, when the history tables
+	 * are created.
+	 */
+	DefineCustomBoolVariable("powa.partition_by_server",
+							 "Partition the history tables by server when creating or updating the extension",
+							 NULL,
+							 &powa_partition_by_server,
+							 false, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("powa.history_index",
+							 "Index layout of the history tables when creating or updating the extension",
+							 NULL,
+							 &powa_history_index,
+							 POWA_HISTORY_INDEX_GIST,
+							 powa_history_index_options,
+							 PGC_SUSET, 0, NULL, NULL, NULL);
+
 	EmitWarningsOnPlaceholders("powa");
 
 	/*
@@ -332,6 +477,8 @@ void
 powa_main(Datum main_arg)
 {
 	StringInfoData query_snapshot;
+	StringInfoData query_migration;
+	StringInfoData query_migration_check;
 	int64		us_to_wait; /* Should be uint64 per postgresql's spec, but we
 							   may have negative result, in our tests */
 
@@ -414,8 +561,9 @@ powa_main(Datum main_arg)
 #endif
 			);
 
-	/* Generate the schema-qualified snapshot query. */
-	powa_get_snapshot_query(&query_snapshot);
+	/* Generate the schema-qualified snapshot and migration queries. */
+	powa_get_snapshot_query(&query_snapshot, &query_migration,
+							&query_migration_check);
 
 	/*------------------
 	 * Main loop of POWA
@@ -453,6 +601,10 @@ powa_main(Datum main_arg)
 			, false
 #endif
 			);
+
+			/* Use the remaining time to convert the history if needed */
+			powa_run_migration_jobs(query_migration.data,
+									query_migration_check.data);
 		}
 
 		/* sleep loop */
@@ -772,3 +924,89 @@ powa_stat_common(PG_FUNCTION_ARGS, PowaStatKind kind)
 
 	return (Datum) 0;
 }
+
+/*
+ * Compatibility layer for the pending migration jobs: apply all the
+ * conversion functions of the pending jobs for the datatype of the given
+ * value.  The conversion functions are idempotent, so it's safe to call them
+ * on values that were already converted.
+ */
+Datum
+powa_migration_read(PG_FUNCTION_ARGS)
+{
+	Oid			typid = get_fn_expr_argtype(fcinfo->flinfo, 0);
+	PowaMigrationCache *cache;
+	Datum		value = PG_GETARG_DATUM(0);
+	int			i;
+
+	if (!OidIsValid(typid))
+		elog(ERROR, "could not determine the datatype of the argument");
+
+	cache = powa_migration_get_cache(fcinfo, typid);
+
+	for (i = 0; i < cache->nfuncs; i++)
+	{
+		value = FunctionCall1(&cache->funcs[i], value);
+	}
+
+	PG_RETURN_DATUM(value);
+}
+
+/*
+ * Get the conversion functions to apply for the given datatype, asking
+ * powa_migration_functions() on the first call of the query.
+ */
+static PowaMigrationCache *
+powa_migration_get_cache(FunctionCallInfo fcinfo, Oid typid)
+{
+	PowaMigrationCache *cache = (PowaMigrationCache *) fcinfo->flinfo->fn_extra;
+	MemoryContext oldcontext;
+	StringInfoData query;
+	Oid			argtypes[1] = {OIDOID};
+	Datum		values[1];
+	char	   *nsp;
+	uint64		i;
+
+	if (cache != NULL && cache->typid == typid)
+		return cache;
+
+	nsp = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+	if (nsp == NULL)
+		elog(ERROR, "could not find the schema of function %u",
+			 fcinfo->flinfo->fn_oid);
+
+	initStringInfo(&query);
+	appendStringInfo(&query, "SELECT %s.powa_migration_functions($1)",
+					 quote_identifier(nsp));
+	values[0] = ObjectIdGetDatum(typid);
+
+	SPI_connect();
+	if (SPI_execute_with_args(query.data, 1, argtypes, values, NULL, true, 0)
+		!= SPI_OK_SELECT)
+		elog(ERROR, "could not get the pending migration functions");
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	cache = palloc0(sizeof(PowaMigrationCache));
+	cache->typid = typid;
+	cache->nfuncs = (int) SPI_processed;
+	if (cache->nfuncs > 0)
+		cache->funcs = palloc0(sizeof(FmgrInfo) * cache->nfuncs);
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		bool		isnull;
+		Datum		val;
+
+		val = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1,
+							&isnull);
+		Assert(!isnull);
+		fmgr_info_cxt(DatumGetObjectId(val), &cache->funcs[i],
+					  fcinfo->flinfo->fn_mcxt);
+	}
+	SPI_finish();
+
+	fcinfo->flinfo->fn_extra = cache;
+
+	return cache;
+}
@@ -0,0 +1,1220 @@
+/*-------------------------------------------------------------------------
+ *
+ * powa_export.c: export of PoWA history data as Apache Arrow IPC streams
+ *
+ * The exported data is written using the Arrow IPC streaming format, so it
+ * can directly be consumed by any Arrow implementation (pyarrow, arrow-rs,
+ * duckdb...) without having to parse the text representation of every
+ * unnested composite record.
+ *
+ * Rows are fetched from a cursor in fixed size batches, and each batch is
+ * emitted as a separate RecordBatch message, so the memory usage stays
+ * bounded whatever the size of the requested time range.  Each RecordBatch
+ * message carries per-column statistics (null count, min and max) in its
+ * custom metadata, under the "powa:statistics" key.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (c) 2018-2025, The PoWA-team
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "access/htup_details.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/json.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/portal.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#define POWA_EXPORT_BATCH_SIZE	10000	/* # of rows per RecordBatch */
+#define POWA_EXPORT_MAX_BUFFERS	3		/* max # of Arrow buffers per column */
+#define POWA_FB_MAX_SLOTS		8		/* max # of fields in a flatbuffer table */
+
+/* Arrow metadata constants, see Arrow's format/Message.fbs and Schema.fbs */
+#define ARROW_METADATA_V5		4
+#define ARROW_HEADER_SCHEMA		1
+#define ARROW_HEADER_RECORDBATCH 3
+#define ARROW_TYPE_INT			2
+#define ARROW_TYPE_FLOAT		3
+#define ARROW_TYPE_UTF8			5
+#define ARROW_TYPE_BOOL			6
+#define ARROW_TYPE_TIMESTAMP	10
+#define ARROW_PRECISION_SINGLE	1
+#define ARROW_PRECISION_DOUBLE	2
+#define ARROW_UNIT_MICROSECOND	2
+
+/* Number of microseconds between the postgres and the unix epoch */
+#define POWA_UNIX_EPOCH_OFFSET \
+	((int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY)
+
+#if PG_VERSION_NUM >= 140000
+#define POWA_WRITE_SERVER_FILES_ROLE	ROLE_PG_WRITE_SERVER_FILES
+#elif PG_VERSION_NUM >= 110000
+#define POWA_WRITE_SERVER_FILES_ROLE	DEFAULT_ROLE_WRITE_SERVER_FILES
+#endif
+
+/* Float timestamps (pg9.6 and below only) are exported as text */
+#if PG_VERSION_NUM >= 100000 || defined(HAVE_INT64_TIMESTAMP)
+#define POWA_EXPORT_INT64_TIMESTAMP
+#endif
+
+typedef enum
+{
+	POWA_ARROW_BOOL,
+	POWA_ARROW_INT,
+	POWA_ARROW_UINT,
+	POWA_ARROW_FLOAT,
+	POWA_ARROW_TIMESTAMP,
+	POWA_ARROW_UTF8
+}	PowaArrowKind;
+
+/*
+ * Minimal flatbuffers builder, only supporting what's needed to generate
+ * Arrow IPC metadata.  Like the reference implementation, the buffer is
+ * filled from the end to the beginning, so that any object can only refer to
+ * objects that were previously created.  Positions are stored as a distance
+ * from the end of the buffer.
+ */
+typedef struct FbBuilder
+{
+	uint8	   *buf;
+	uint32		cap;
+	uint32		used;
+	uint32		minalign;
+	uint32		tbl_start;
+	int			nslots;
+	uint32		slots[POWA_FB_MAX_SLOTS];
+}	FbBuilder;
+
+typedef struct PowaExportColumn
+{
+	char	   *name;
+	PowaArrowKind kind;
+	int			width;			/* in bytes, for fixed width types */
+	bool		has_tz;			/* for timestamps */
+	Oid			typoutput;		/* for text output */
+	/* per-batch data */
+	uint8	   *validity;
+	uint8	   *values;
+	int32	   *offsets;
+	StringInfoData data;
+	int64		null_count;
+	/* per-batch statistics */
+	bool		has_minmax;
+	int64		imin;
+	int64		imax;
+	uint64		umin;
+	uint64		umax;
+	double		fmin;
+	double		fmax;
+}	PowaExportColumn;
+
+typedef struct PowaExportState
+{
+	/* output: either a server-side file or a tuplestore of bytea */
+	FILE	   *file;
+	const char *filename;
+	off_t		written;		/* # of bytes written to the file */
+	off_t		flushed;		/* # of bytes asked to be written back */
+	off_t		dropped;		/* # of bytes evicted from the page cache */
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	/* exported data */
+	int			ncols;
+	PowaExportColumn *cols;
+	int64		nrows;
+}	PowaExportState;
+
+Datum		powa_export_history(PG_FUNCTION_ARGS);
+Datum		powa_export_history_to_file(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(powa_export_history);
+PG_FUNCTION_INFO_V1(powa_export_history_to_file);
+
+static int64 powa_export_common(FunctionCallInfo fcinfo, PowaExportState *state);
+static void powa_export_open_file(PowaExportState *state);
+static void powa_export_release_cache(PowaExportState *state);
+static void powa_export_init_columns(PowaExportState *state, TupleDesc desc);
+static void powa_export_process_batch(PowaExportState *state,
+									  SPITupleTable *tuptable, int nrows);
+static void powa_export_write_schema(PowaExportState *state, int32 srvid,
+									 const char *relname, TimestampTz from,
+									 TimestampTz to);
+static void powa_export_write_batch(PowaExportState *state, int nrows);
+static void powa_export_write_message(PowaExportState *state, FbBuilder *fbb,
+									  StringInfo body);
+static void powa_export_write_raw(PowaExportState *state, const char *data,
+								  int len);
+
+static void fb_init(FbBuilder *b);
+static uint32 fb_start_table(FbBuilder *b);
+static uint32 fb_end_table(FbBuilder *b);
+static void fb_add_scalar(FbBuilder *b, int slot, uint64 value, int size);
+static void fb_add_offset(FbBuilder *b, int slot, uint32 ref);
+static uint32 fb_create_string(FbBuilder *b, const char *str);
+static uint32 fb_create_offset_vector(FbBuilder *b, uint32 *refs, int n);
+static uint32 fb_create_pair_vector(FbBuilder *b, int64 *pairs, int n);
+static uint32 fb_create_keyvalue(FbBuilder *b, const char *key,
+								 const char *value);
+static void fb_finish(FbBuilder *b, uint32 root);
+
+/*
+ * Export the given history relation as an Arrow IPC stream, returned as a set
+ * of bytea, one per Arrow message.  Concatenating all the rows gives the
+ * complete stream.
+ */
+Datum
+powa_export_history(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	PowaExportState state;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	memset(&state, 0, sizeof(state));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our bytea result */
+	state.tupdesc = CreateTemplateTupleDesc(1
+#if PG_VERSION_NUM < 120000
+											,false
+#endif
+											);
+	TupleDescInitEntry(state.tupdesc, (AttrNumber) 1, "powa_export_history",
+					   BYTEAOID, -1, 0);
+
+	/*
+	 * The tuplestore will spill to disk once work_mem is exceeded, so the
+	 * memory usage stays bounded.
+	 */
+	state.tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = state.tupstore;
+	rsinfo->setDesc = state.tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	powa_export_common(fcinfo, &state);
+
+	return (Datum) 0;
+}
+
+/*
+ * Export the given history relation as an Arrow IPC stream written to the
+ * given server-side file.  Returns the number of exported rows.
+ */
+Datum
+powa_export_history_to_file(PG_FUNCTION_ARGS)
+{
+	PowaExportState state;
+	char	   *filename = text_to_cstring(PG_GETARG_TEXT_PP(4));
+	int64		nrows;
+
+	/* Same restrictions as COPY TO a file */
+#ifdef POWA_WRITE_SERVER_FILES_ROLE
+	if (!superuser() &&
+		!has_privs_of_role(GetUserId(), POWA_WRITE_SERVER_FILES_ROLE))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser or a member of the pg_write_server_files role to export to a file")));
+#else
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to export to a file")));
+#endif
+
+	if (!is_absolute_path(filename))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_NAME),
+				 errmsg("relative path not allowed for export to file")));
+
+	memset(&state, 0, sizeof(state));
+	state.filename = filename;
+
+	/*
+	 * The file is only opened once the export query has been generated and
+	 * validated, see powa_export_common().
+	 */
+	nrows = powa_export_common(fcinfo, &state);
+
+	if (FreeFile(state.file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", filename)));
+
+	PG_RETURN_INT64(nrows);
+}
+
+/*
+ * Main export loop, shared by the SRF and the file versions.  Returns the
+ * number of exported rows.
+ */
+static int64
+powa_export_common(FunctionCallInfo fcinfo, PowaExportState *state)
+{
+	int32		srvid = PG_GETARG_INT32(0);
+	char	   *relname = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	TimestampTz from = PG_GETARG_TIMESTAMPTZ(2);
+	TimestampTz to = PG_GETARG_TIMESTAMPTZ(3);
+	char	   *nsp;
+	StringInfoData buf;
+	Oid			argtypes[3] = {INT4OID, TIMESTAMPTZOID, TIMESTAMPTZOID};
+	Datum		args[3];
+	Oid			qargtypes[1] = {TEXTOID};
+	Datum		qargs[1];
+	char	   *query;
+	bool		isnull;
+	Portal		portal;
+	MemoryContext batch_ctx;
+	MemoryContext oldcontext;
+	int			ret;
+
+	/* The query generation function lives in the same schema as we do */
+	nsp = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+
+	SPI_connect();
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "SELECT %s.powa_export_history_query($1)",
+					 quote_identifier(nsp));
+	qargs[0] = CStringGetTextDatum(relname);
+	ret = SPI_execute_with_args(buf.data, 1, qargtypes, qargs, NULL, true, 1);
+	if (ret != SPI_OK_SELECT || SPI_processed != 1)
+		elog(ERROR, "could not generate the export query for \"%s\"",
+			 relname);
+
+	query = TextDatumGetCString(SPI_getbinval(SPI_tuptable->vals[0],
+											  SPI_tuptable->tupdesc, 1,
+											  &isnull));
+	Assert(!isnull);
+
+	args[0] = Int32GetDatum(srvid);
+	args[1] = TimestampTzGetDatum(from);
+	args[2] = TimestampTzGetDatum(to);
+	portal = SPI_cursor_open_with_args(NULL, query, 3, argtypes, args, NULL,
+									   true, CURSOR_OPT_NO_SCROLL);
+
+	/*
+	 * Only create the output file now that the query is known to be valid, so
+	 * that no empty file is left behind on an invalid relation name.
+	 */
+	if (state->filename != NULL)
+		powa_export_open_file(state);
+
+	/*
+	 * All the per-batch data is allocated in a dedicated memory context, reset
+	 * after each batch.
+	 */
+	batch_ctx = AllocSetContextCreate(CurrentMemoryContext,
+									  "PoWA export batch",
+#if PG_VERSION_NUM >= 90600
+									  ALLOCSET_DEFAULT_SIZES
+#else
+									  ALLOCSET_DEFAULT_MINSIZE,
+									  ALLOCSET_DEFAULT_INITSIZE,
+									  ALLOCSET_DEFAULT_MAXSIZE
+#endif
+									  );
+
+	powa_export_init_columns(state, portal->tupDesc);
+	oldcontext = MemoryContextSwitchTo(batch_ctx);
+	powa_export_write_schema(state, srvid, relname, from, to);
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(batch_ctx);
+
+	for (;;)
+	{
+		int			nrows;
+
+		CHECK_FOR_INTERRUPTS();
+
+		SPI_cursor_fetch(portal, true, POWA_EXPORT_BATCH_SIZE);
+		nrows = (int) SPI_processed;
+
+		if (nrows == 0)
+			break;
+
+		oldcontext = MemoryContextSwitchTo(batch_ctx);
+		powa_export_process_batch(state, SPI_tuptable, nrows);
+		powa_export_write_batch(state, nrows);
+		MemoryContextSwitchTo(oldcontext);
+
+		SPI_freetuptable(SPI_tuptable);
+		MemoryContextReset(batch_ctx);
+
+		state->nrows += nrows;
+
+		powa_export_release_cache(state);
+	}
+
+	/* end of stream marker */
+	{
+		uint8		eos[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0};
+
+		powa_export_write_raw(state, (const char *) eos, sizeof(eos));
+	}
+
+	SPI_cursor_close(portal);
+	MemoryContextDelete(batch_ctx);
+	SPI_finish();
+
+	return state->nrows;
+}
+
+/*
+ * Open the output file of powa_export_history_to_file(), with the same
+ * permissions as COPY TO a file.
+ */
+static void
+powa_export_open_file(PowaExportState *state)
+{
+	mode_t		oumask;
+
+	oumask = umask(S_IWGRP | S_IWOTH);
+	PG_TRY();
+	{
+		state->file = AllocateFile(state->filename, PG_BINARY_W);
+	}
+	PG_CATCH();
+	{
+		umask(oumask);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	umask(oumask);
+
+	if (state->file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for writing: %m",
+						state->filename)));
+}
+
+/*
+ * Exporting a big time range can generate files way bigger than the
+ * repository working set.  Make sure that the exported data doesn't stay in
+ * the OS page cache: after each batch, ask the kernel to start writing back
+ * the new data, and evict the data that was previously written back.
+ */
+static void
+powa_export_release_cache(PowaExportState *state)
+{
+	if (state->file == NULL)
+		return;
+
+	if (fflush(state->file) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to file \"%s\": %m",
+						state->filename)));
+
+#if defined(USE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+	if (state->flushed > state->dropped)
+	{
+		(void) posix_fadvise(fileno(state->file), state->dropped,
+							 state->flushed - state->dropped,
+							 POSIX_FADV_DONTNEED);
+		state->dropped = state->flushed;
+	}
+#endif
+
+#if PG_VERSION_NUM >= 90600
+	if (state->written > state->flushed)
+		pg_flush_data(fileno(state->file), state->flushed,
+					  state->written - state->flushed);
+#endif
+	state->flushed = state->written;
+}
+
+/*
+ * Map each column of the exported query to an Arrow datatype.  Any datatype
+ * without a direct Arrow equivalent (numeric, interval, inet...) is exported
+ * using its text representation to avoid any loss of precision.
+ */
+static void
+powa_export_init_columns(PowaExportState *state, TupleDesc desc)
+{
+	int			i;
+
+	state->ncols = desc->natts;
+	state->cols = palloc0(sizeof(PowaExportColumn) * desc->natts);
+
+	for (i = 0; i < desc->natts; i++)
+	{
+		PowaExportColumn *col = &state->cols[i];
+		Form_pg_attribute attr = TupleDescAttr(desc, i);
+		bool		isvarlena;
+
+		col->name = pstrdup(NameStr(attr->attname));
+
+		switch (attr->atttypid)
+		{
+			case BOOLOID:
+				col->kind = POWA_ARROW_BOOL;
+				break;
+			case INT2OID:
+				col->kind = POWA_ARROW_INT;
+				col->width = 2;
+				break;
+			case INT4OID:
+				col->kind = POWA_ARROW_INT;
+				col->width = 4;
+				break;
+			case INT8OID:
+				col->kind = POWA_ARROW_INT;
+				col->width = 8;
+				break;
+			case OIDOID:
+			case XIDOID:
+				col->kind = POWA_ARROW_UINT;
+				col->width = 4;
+				break;
+			case LSNOID:
+				col->kind = POWA_ARROW_UINT;
+				col->width = 8;
+				break;
+			case FLOAT4OID:
+				col->kind = POWA_ARROW_FLOAT;
+				col->width = 4;
+				break;
+			case FLOAT8OID:
+				col->kind = POWA_ARROW_FLOAT;
+				col->width = 8;
+				break;
+#ifdef POWA_EXPORT_INT64_TIMESTAMP
+			case TIMESTAMPTZOID:
+			case TIMESTAMPOID:
+				col->kind = POWA_ARROW_TIMESTAMP;
+				col->width = 8;
+				col->has_tz = (attr->atttypid == TIMESTAMPTZOID);
+				break;
+#endif
+			default:
+				col->kind = POWA_ARROW_UTF8;
+				getTypeOutputInfo(attr->atttypid, &col->typoutput, &isvarlena);
+				break;
+		}
+	}
+}
+
+/*
+ * Transpose a batch of rows into per-column Arrow buffers, and compute the
+ * per-column statistics.  Must be called in the per-batch memory context.
+ */
+static void
+powa_export_process_batch(PowaExportState *state, SPITupleTable *tuptable,
+						  int nrows)
+{
+	TupleDesc	desc = tuptable->tupdesc;
+	Datum	   *values = palloc(sizeof(Datum) * state->ncols);
+	bool	   *nulls = palloc(sizeof(bool) * state->ncols);
+	int			bitmaplen = (nrows + 7) / 8;
+	int			row;
+	int			i;
+
+	for (i = 0; i < state->ncols; i++)
+	{
+		PowaExportColumn *col = &state->cols[i];
+
+		col->validity = palloc0(bitmaplen);
+		col->null_count = 0;
+		col->has_minmax = false;
+
+		if (col->kind == POWA_ARROW_BOOL)
+			col->values = palloc0(bitmaplen);
+		else if (col->kind == POWA_ARROW_UTF8)
+		{
+			col->offsets = palloc(sizeof(int32) * (nrows + 1));
+			col->offsets[0] = 0;
+			initStringInfo(&col->data);
+		}
+		else
+			col->values = palloc0((Size) col->width * nrows);
+	}
+
+	for (row = 0; row < nrows; row++)
+	{
+		heap_deform_tuple(tuptable->vals[row], desc, values, nulls);
+
+		for (i = 0; i < state->ncols; i++)
+		{
+			PowaExportColumn *col = &state->cols[i];
+			Datum		d = values[i];
+			bool		isnull = nulls[i];
+
+#ifdef POWA_EXPORT_INT64_TIMESTAMP
+			/* infinite timestamps can't be represented in Arrow */
+			if (!isnull && col->kind == POWA_ARROW_TIMESTAMP &&
+				TIMESTAMP_NOT_FINITE(DatumGetTimestampTz(d)))
+				isnull = true;
+#endif
+
+			if (isnull)
+			{
+				col->null_count++;
+				if (col->kind == POWA_ARROW_UTF8)
+					col->offsets[row + 1] = col->data.len;
+				continue;
+			}
+
+			col->validity[row / 8] |= (1 << (row % 8));
+
+			switch (col->kind)
+			{
+				case POWA_ARROW_BOOL:
+					if (DatumGetBool(d))
+						col->values[row / 8] |= (1 << (row % 8));
+					break;
+				case POWA_ARROW_INT:
+				case POWA_ARROW_TIMESTAMP:
+					{
+						int64		v;
+
+						if (col->kind == POWA_ARROW_TIMESTAMP)
+						{
+							v = DatumGetTimestampTz(d) + POWA_UNIX_EPOCH_OFFSET;
+							memcpy(col->values + row * 8, &v, 8);
+						}
+						else if (col->width == 2)
+						{
+							int16		v16 = DatumGetInt16(d);
+
+							v = v16;
+							memcpy(col->values + row * 2, &v16, 2);
+						}
+						else if (col->width == 4)
+						{
+							int32		v32 = DatumGetInt32(d);
+
+							v = v32;
+							memcpy(col->values + row * 4, &v32, 4);
+						}
+						else
+						{
+							v = DatumGetInt64(d);
+							memcpy(col->values + row * 8, &v, 8);
+						}
+
+						if (!col->has_minmax || v < col->imin)
+							col->imin = v;
+						if (!col->has_minmax || v > col->imax)
+							col->imax = v;
+						col->has_minmax = true;
+						break;
+					}
+				case POWA_ARROW_UINT:
+					{
+						uint64		v;
+
+						if (col->width == 4)
+						{
+							uint32		v32 = DatumGetUInt32(d);
+
+							v = v32;
+							memcpy(col->values + row * 4, &v32, 4);
+						}
+						else
+						{
+							v = (uint64) DatumGetInt64(d);
+							memcpy(col->values + row * 8, &v, 8);
+						}
+
+						if (!col->has_minmax || v < col->umin)
+							col->umin = v;
+						if (!col->has_minmax || v > col->umax)
+							col->umax = v;
+						col->has_minmax = true;
+						break;
+					}
+				case POWA_ARROW_FLOAT:
+					{
+						double		v;
+
+						if (col->width == 4)
+						{
+							float4		v4 = DatumGetFloat4(d);
+
+							v = v4;
+							memcpy(col->values + row * 4, &v4, 4);
+						}
+						else
+						{
+							v = DatumGetFloat8(d);
+							memcpy(col->values + row * 8, &v, 8);
+						}
+
+						/* NaN and infinity aren't representable in json */
+						if (isnan(v) || isinf(v))
+							break;
+
+						if (!col->has_minmax || v < col->fmin)
+							col->fmin = v;
+						if (!col->has_minmax || v > col->fmax)
+							col->fmax = v;
+						col->has_minmax = true;
+						break;
+					}
+				case POWA_ARROW_UTF8:
+					{
+						char	   *str = OidOutputFunctionCall(col->typoutput, d);
+
+						appendStringInfoString(&col->data, str);
+						pfree(str);
+						col->offsets[row + 1] = col->data.len;
+						break;
+					}
+			}
+		}
+	}
+}
+
+/*
+ * Emit the Schema message, describing all the exported columns.  The
+ * selection parameters are stored in the schema custom metadata.
+ */
+static void
+powa_export_write_schema(PowaExportState *state, int32 srvid,
+						 const char *relname, TimestampTz from, TimestampTz to)
+{
+	FbBuilder	fbb;
+	uint32	   *fields = palloc(sizeof(uint32) * Max(state->ncols, 1));
+	uint32		md[4];
+	uint32		ref;
+	uint32		schema;
+	char		srvid_str[12];
+	int			i;
+
+	fb_init(&fbb);
+
+	for (i = 0; i < state->ncols; i++)
+	{
+		PowaExportColumn *col = &state->cols[i];
+		uint32		name = fb_create_string(&fbb, col->name);
+		uint32		children = fb_create_offset_vector(&fbb, NULL, 0);
+		uint32		tz = 0;
+		uint32		type;
+		uint8		type_type = 0;
+
+		if (col->kind == POWA_ARROW_TIMESTAMP && col->has_tz)
+			tz = fb_create_string(&fbb, "UTC");
+
+		fb_start_table(&fbb);
+		switch (col->kind)
+		{
+			case POWA_ARROW_BOOL:
+				type_type = ARROW_TYPE_BOOL;
+				break;
+			case POWA_ARROW_INT:
+			case POWA_ARROW_UINT:
+				type_type = ARROW_TYPE_INT;
+				fb_add_scalar(&fbb, 0, col->width * 8, 4);	/* bitWidth */
+				fb_add_scalar(&fbb, 1, col->kind == POWA_ARROW_INT, 1);	/* is_signed */
+				break;
+			case POWA_ARROW_FLOAT:
+				type_type = ARROW_TYPE_FLOAT;
+				fb_add_scalar(&fbb, 0, col->width == 4 ? ARROW_PRECISION_SINGLE
+							  : ARROW_PRECISION_DOUBLE, 2);	/* precision */
+				break;
+			case POWA_ARROW_TIMESTAMP:
+				type_type = ARROW_TYPE_TIMESTAMP;
+				if (tz != 0)
+					fb_add_offset(&fbb, 1, tz);	/* timezone */
+				fb_add_scalar(&fbb, 0, ARROW_UNIT_MICROSECOND, 2);	/* unit */
+				break;
+			case POWA_ARROW_UTF8:
+				type_type = ARROW_TYPE_UTF8;
+				break;
+		}
+		type = fb_end_table(&fbb);
+
+		/* Field table */
+		fb_start_table(&fbb);
+		fb_add_offset(&fbb, 0, name);		/* name */
+		fb_add_offset(&fbb, 3, type);		/* type */
+		fb_add_offset(&fbb, 5, children);	/* children */
+		fb_add_scalar(&fbb, 1, 1, 1);		/* nullable */
+		fb_add_scalar(&fbb, 2, type_type, 1);	/* type_type */
+		fields[i] = fb_end_table(&fbb);
+	}
+	ref = fb_create_offset_vector(&fbb, fields, state->ncols);
+
+	snprintf(srvid_str, sizeof(srvid_str), "%d", srvid);
+	md[0] = fb_create_keyvalue(&fbb, "powa:relation", relname);
+	md[1] = fb_create_keyvalue(&fbb, "powa:srvid", srvid_str);
+	md[2] = fb_create_keyvalue(&fbb, "powa:from", timestamptz_to_str(from));
+	md[3] = fb_create_keyvalue(&fbb, "powa:to", timestamptz_to_str(to));
+	md[0] = fb_create_offset_vector(&fbb, md, 4);
+
+	/* Schema table */
+	fb_start_table(&fbb);
+	fb_add_offset(&fbb, 1, ref);		/* fields */
+	fb_add_offset(&fbb, 2, md[0]);		/* custom_metadata */
+#ifdef WORDS_BIGENDIAN
+	fb_add_scalar(&fbb, 0, 1, 2);		/* endianness: Big */
+#else
+	fb_add_scalar(&fbb, 0, 0, 2);		/* endianness: Little */
+#endif
+	schema = fb_end_table(&fbb);
+
+	/* Message table */
+	fb_start_table(&fbb);
+	fb_add_scalar(&fbb, 3, 0, 8);		/* bodyLength */
+	fb_add_offset(&fbb, 2, schema);		/* header */
+	fb_add_scalar(&fbb, 0, ARROW_METADATA_V5, 2);	/* version */
+	fb_add_scalar(&fbb, 1, ARROW_HEADER_SCHEMA, 1);	/* header_type */
+	fb_finish(&fbb, fb_end_table(&fbb));
+
+	powa_export_write_message(state, &fbb, NULL);
+}
+
+/*
+ * Append a buffer to the message body, with the 8 bytes alignment required
+ * by Arrow, and remember its position.
+ */
+static void
+powa_export_add_buffer(StringInfo body, int64 *buffers, int *nbuffers,
+					   const void *data, int len)
+{
+	buffers[*nbuffers * 2] = body->len;
+	buffers[*nbuffers * 2 + 1] = len;
+	(*nbuffers)++;
+
+	if (len > 0)
+		appendBinaryStringInfo(body, data, len);
+	while (body->len % 8 != 0)
+		appendStringInfoCharMacro(body, '\0');
+}
+
+/*
+ * Emit a RecordBatch message for the current batch, with its per-column
+ * statistics.
+ */
+static void
+powa_export_write_batch(PowaExportState *state, int nrows)
+{
+	FbBuilder	fbb;
+	StringInfoData body;
+	StringInfoData stats;
+	int64	   *nodes = palloc(sizeof(int64) * 2 * Max(state->ncols, 1));
+	int64	   *buffers = palloc(sizeof(int64) * 2 * POWA_EXPORT_MAX_BUFFERS *
+								 Max(state->ncols, 1));
+	int			nbuffers = 0;
+	int			bitmaplen = (nrows + 7) / 8;
+	uint32		ref_nodes;
+	uint32		ref_buffers;
+	uint32		ref_md;
+	uint32		batch;
+	int			i;
+
+	initStringInfo(&body);
+	initStringInfo(&stats);
+	appendStringInfo(&stats, "{\"rows\": %d, \"columns\": [", nrows);
+
+	for (i = 0; i < state->ncols; i++)
+	{
+		PowaExportColumn *col = &state->cols[i];
+
+		nodes[i * 2] = nrows;
+		nodes[i * 2 + 1] = col->null_count;
+
+		/* The validity bitmap can be omitted if there are no NULLs */
+		powa_export_add_buffer(&body, buffers, &nbuffers, col->validity,
+							   col->null_count > 0 ? bitmaplen : 0);
+
+		switch (col->kind)
+		{
+			case POWA_ARROW_BOOL:
+				powa_export_add_buffer(&body, buffers, &nbuffers, col->values,
+									   bitmaplen);
+				break;
+			case POWA_ARROW_UTF8:
+				powa_export_add_buffer(&body, buffers, &nbuffers, col->offsets,
+									   sizeof(int32) * (nrows + 1));
+				powa_export_add_buffer(&body, buffers, &nbuffers,
+									   col->data.data, col->data.len);
+				break;
+			default:
+				powa_export_add_buffer(&body, buffers, &nbuffers, col->values,
+									   col->width * nrows);
+				break;
+		}
+
+		if (i > 0)
+			appendStringInfoString(&stats, ", ");
+		appendStringInfoString(&stats, "{\"name\": ");
+		escape_json(&stats, col->name);
+		appendStringInfo(&stats, ", \"null_count\": " INT64_FORMAT,
+						 col->null_count);
+		if (col->has_minmax)
+		{
+			switch (col->kind)
+			{
+				case POWA_ARROW_INT:
+				case POWA_ARROW_TIMESTAMP:
+					appendStringInfo(&stats,
+									 ", \"min\": " INT64_FORMAT
+									 ", \"max\": " INT64_FORMAT,
+									 col->imin, col->imax);
+					break;
+				case POWA_ARROW_UINT:
+					appendStringInfo(&stats,
+									 ", \"min\": " UINT64_FORMAT
+									 ", \"max\": " UINT64_FORMAT,
+									 col->umin, col->umax);
+					break;
+				case POWA_ARROW_FLOAT:
+					appendStringInfo(&stats, ", \"min\": %.17g, \"max\": %.17g",
+									 col->fmin, col->fmax);
+					break;
+				default:
+					break;
+			}
+		}
+		appendStringInfoChar(&stats, '}');
+	}
+	appendStringInfoString(&stats, "]}");
+
+	fb_init(&fbb);
+
+	ref_nodes = fb_create_pair_vector(&fbb, nodes, state->ncols);
+	ref_buffers = fb_create_pair_vector(&fbb, buffers, nbuffers);
+
+	/* RecordBatch table */
+	fb_start_table(&fbb);
+	fb_add_scalar(&fbb, 0, nrows, 8);	/* length */
+	fb_add_offset(&fbb, 1, ref_nodes);	/* nodes */
+	fb_add_offset(&fbb, 2, ref_buffers);	/* buffers */
+	batch = fb_end_table(&fbb);
+
+	ref_md = fb_create_keyvalue(&fbb, "powa:statistics", stats.data);
+	ref_md = fb_create_offset_vector(&fbb, &ref_md, 1);
+
+	/* Message table */
+	fb_start_table(&fbb);
+	fb_add_scalar(&fbb, 3, body.len, 8);	/* bodyLength */
+	fb_add_offset(&fbb, 2, batch);		/* header */
+	fb_add_offset(&fbb, 4, ref_md);		/* custom_metadata */
+	fb_add_scalar(&fbb, 0, ARROW_METADATA_V5, 2);	/* version */
+	fb_add_scalar(&fbb, 1, ARROW_HEADER_RECORDBATCH, 1);	/* header_type */
+	fb_finish(&fbb, fb_end_table(&fbb));
+
+	powa_export_write_message(state, &fbb, &body);
+}
+
+/*
+ * Write a complete encapsulated Arrow message: continuation marker, metadata
+ * length, flatbuffer metadata padded to 8 bytes and the optional body.
+ */
+static void
+powa_export_write_message(PowaExportState *state, FbBuilder *fbb,
+						  StringInfo body)
+{
+	StringInfoData msg;
+	uint32		metalen = TYPEALIGN(8, fbb->used);
+	uint8		prefix[8];
+	int			i;
+
+	for (i = 0; i < 4; i++)
+	{
+		prefix[i] = 0xFF;
+		prefix[4 + i] = (metalen >> (i * 8)) & 0xFF;
+	}
+
+	initStringInfo(&msg);
+	appendBinaryStringInfo(&msg, (const char *) prefix, sizeof(prefix));
+	appendBinaryStringInfo(&msg, (const char *) fbb->buf + fbb->cap - fbb->used,
+						   fbb->used);
+	while (msg.len % 8 != 0)
+		appendStringInfoCharMacro(&msg, '\0');
+
+	/*
+	 * Avoid another copy of the body for file output, but in the SRF case we
+	 * want a single bytea per message.
+	 */
+	if (state->file != NULL || body == NULL)
+	{
+		powa_export_write_raw(state, msg.data, msg.len);
+		if (body != NULL)
+			powa_export_write_raw(state, body->data, body->len);
+	}
+	else
+	{
+		appendBinaryStringInfo(&msg, body->data, body->len);
+		powa_export_write_raw(state, msg.data, msg.len);
+	}
+
+	pfree(msg.data);
+}
+
+static void
+powa_export_write_raw(PowaExportState *state, const char *data, int len)
+{
+	if (state->file != NULL)
+	{
+		if (fwrite(data, 1, len, state->file) != (size_t) len)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write to file \"%s\": %m",
+							state->filename)));
+		state->written += len;
+	}
+	else
+	{
+		Datum		value;
+		bool		isnull = false;
+		bytea	   *res = palloc(VARHDRSZ + len);
+
+		SET_VARSIZE(res, VARHDRSZ + len);
+		memcpy(VARDATA(res), data, len);
+		value = PointerGetDatum(res);
+
+		tuplestore_putvalues(state->tupstore, state->tupdesc, &value, &isnull);
+		pfree(res);
+	}
+}
+
+/*---- flatbuffers builder ----*/
+
+static void
+fb_init(FbBuilder *b)
+{
+	memset(b, 0, sizeof(FbBuilder));
+	b->cap = 1024;
+	b->buf = palloc(b->cap);
+	b->minalign = 1;
+}
+
+/* Make sure that at least "needed" bytes are available */
+static void
+fb_reserve(FbBuilder *b, uint32 needed)
+{
+	uint32		newcap = b->cap;
+	uint8	   *newbuf;
+
+	while (newcap - b->used < needed)
+		newcap *= 2;
+
+	if (newcap == b->cap)
+		return;
+
+	/* data lives at the end of the buffer */
+	newbuf = palloc(newcap);
+	memcpy(newbuf + newcap - b->used, b->buf + b->cap - b->used, b->used);
+	pfree(b->buf);
+	b->buf = newbuf;
+	b->cap = newcap;
+}
+
+static void
+fb_push_bytes(FbBuilder *b, const void *data, uint32 len)
+{
+	fb_reserve(b, len);
+	b->used += len;
+	if (data)
+		memcpy(b->buf + b->cap - b->used, data, len);
+	else
+		memset(b->buf + b->cap - b->used, 0, len);
+}
+
+/*
+ * Add padding so that once "additional" bytes are written, the next write of
+ * "size" bytes will be aligned.
+ */
+static void
+fb_prep(FbBuilder *b, uint32 size, uint32 additional)
+{
+	if (size > b->minalign)
+		b->minalign = size;
+
+	fb_push_bytes(b, NULL, (~(b->used + additional) + 1) & (size - 1));
+}
+
+/* flatbuffers are always little-endian */
+static void
+fb_push_scalar(FbBuilder *b, uint64 value, int size)
+{
+	uint8		tmp[8];
+	int			i;
+
+	for (i = 0; i < size; i++)
+	{
+		tmp[i] = value & 0xFF;
+		value >>= 8;
+	}
+
+	fb_prep(b, size, 0);
+	fb_push_bytes(b, tmp, size);
+}
+
+/* Push an uoffset pointing to the previously created object "ref" */
+static void
+fb_push_offset(FbBuilder *b, uint32 ref)
+{
+	fb_prep(b, 4, 0);
+	Assert(ref <= b->used);
+	fb_push_scalar(b, b->used - ref + 4, 4);
+}
+
+static uint32
+fb_start_table(FbBuilder *b)
+{
+	b->nslots = 0;
+	memset(b->slots, 0, sizeof(b->slots));
+	b->tbl_start = b->used;
+
+	return b->tbl_start;
+}
+
+static void
+fb_track_slot(FbBuilder *b, int slot)
+{
+	Assert(slot < POWA_FB_MAX_SLOTS);
+	b->slots[slot] = b->used;
+	if (slot >= b->nslots)
+		b->nslots = slot + 1;
+}
+
+static void
+fb_add_scalar(FbBuilder *b, int slot, uint64 value, int size)
+{
+	fb_push_scalar(b, value, size);
+	fb_track_slot(b, slot);
+}
+
+static void
+fb_add_offset(FbBuilder *b, int slot, uint32 ref)
+{
+	fb_push_offset(b, ref);
+	fb_track_slot(b, slot);
+}
+
+/*
+ * Write the table header and its vtable.  Vtables aren't deduplicated, as the
+ * generated metadata is small anyway.
+ */
+static uint32
+fb_end_table(FbBuilder *b)
+{
+	uint32		tbl;
+	int32		soffset;
+	uint8	   *pos;
+	int			i;
+
+	/* placeholder for the soffset to the vtable */
+	fb_push_scalar(b, 0, 4);
+	tbl = b->used;
+
+	for (i = b->nslots - 1; i >= 0; i--)
+		fb_push_scalar(b, b->slots[i] ? tbl - b->slots[i] : 0, 2);
+	fb_push_scalar(b, tbl - b->tbl_start, 2);
+	fb_push_scalar(b, (b->nslots + 2) * 2, 2);
+
+	/* the vtable is located before the table */
+	soffset = (int32) (b->used - tbl);
+	pos = b->buf + b->cap - tbl;
+	for (i = 0; i < 4; i++)
+		pos[i] = ((uint32) soffset >> (i * 8)) & 0xFF;
+
+	b->nslots = 0;
+
+	return tbl;
+}
+
+static uint32
+fb_create_string(FbBuilder *b, const char *str)
+{
+	uint32		len = strlen(str);
+
+	fb_prep(b, 4, len + 1);
+	fb_push_bytes(b, NULL, 1);	/* trailing NUL */
+	fb_push_bytes(b, str, len);
+	fb_push_scalar(b, len, 4);
+
+	return b->used;
+}
+
+static uint32
+fb_create_offset_vector(FbBuilder *b, uint32 *refs, int n)
+{
+	int			i;
+
+	fb_prep(b, 4, n * 4);
+	for (i = n - 1; i >= 0; i--)
+		fb_push_offset(b, refs[i]);
+	fb_push_scalar(b, n, 4);
+
+	return b->used;
+}
+
+/*
+ * Create a vector of structs made of two int64, which is the case for both
+ * the FieldNode and the Buffer structs.
+ */
+static uint32
+fb_create_pair_vector(FbBuilder *b, int64 *pairs, int n)
+{
+	int			i;
+
+	fb_prep(b, 4, n * 16);
+	fb_prep(b, 8, n * 16);
+	for (i = n - 1; i >= 0; i--)
+	{
+		fb_push_scalar(b, (uint64) pairs[i * 2 + 1], 8);
+		fb_push_scalar(b, (uint64) pairs[i * 2], 8);
+	}
+	fb_push_scalar(b, n, 4);
+
+	return b->used;
+}
+
+static uint32
+fb_create_keyvalue(FbBuilder *b, const char *key, const char *value)
+{
+	uint32		k = fb_create_string(b, key);
+	uint32		v = fb_create_string(b, value);
+
+	fb_start_table(b);
+	fb_add_offset(b, 0, k);
+	fb_add_offset(b, 1, v);
+
+	return fb_end_table(b);
+}
+
+static void
+fb_finish(FbBuilder *b, uint32 root)
+{
+	fb_prep(b, b->minalign, 4);
+	fb_push_offset(b, root);
+}
@@ -136,6 +136,240 @@ SELECT 3, COUNT(*) > 0 FROM "PoWA".powa_statements_history;
 SELECT 3, count(*) > 4 FROM "PoWA".powa_stat_get_activity(0, '-infinity', 'infinity');
 SELECT 3, count(*) = 0 FROM "PoWA".powa_stat_get_activity(42, '-infinity', 'infinity');
 
+-- Test the Arrow IPC export: a schema message, at least a record batch and the
+-- end of stream marker, all starting with a continuation marker
+SELECT 3, count(*) >= 3 AND bool_and(substr(m, 1, 4) = '\xffffffff'::bytea)
+FROM "PoWA".powa_export_history(0, 'powa_statements_history') m;
+SELECT * FROM "PoWA".powa_export_history(0, 'powa_servers');
+-- An invalid relation shouldn't leave an empty file behind
+SELECT current_setting('data_directory') || '/powa_export.arrow' AS export_path \gset
+SELECT "PoWA".powa_export_history_to_file(0, 'powa_servers', '-infinity',
+    'infinity', :'export_path');
+SELECT 3, pg_stat_file(:'export_path', true) IS NULL;
+-- A successful file export should contain all the records of the range, and
+-- be identical to the returned stream
+SELECT current_setting('data_directory') || '/powa_export_ok.arrow' AS export_path \gset
+SELECT "PoWA".powa_export_history_to_file(0, 'powa_statements_history',
+    '-infinity', 'infinity', :'export_path') AS nb_exported \gset
+SELECT 3, :nb_exported > 0,
+    :nb_exported = (SELECT count(*)
+        FROM (SELECT unnest(records)
+            FROM "PoWA".powa_statements_history
+            WHERE srvid = 0) h)
+    + (SELECT count(*)
+        FROM "PoWA".powa_statements_history_current
+        WHERE srvid = 0) AS all_exported,
+    (pg_stat_file(:'export_path')).size > 0 AS has_data,
+    pg_read_binary_file(:'export_path') = (SELECT string_agg(m, ''::bytea ORDER BY num)
+        FROM "PoWA".powa_export_history(0, 'powa_statements_history')
+            WITH ORDINALITY m(m, num)) AS same_stream;
+
+-- Minimal Arrow IPC decoder, to check the content of the exported messages
+CREATE FUNCTION arrow_uint(m bytea, pos bigint, size int) RETURNS bigint
+AS $$
+    SELECT sum(get_byte(m, (pos + i)::int)::bigint << (8 * i))::bigint
+    FROM generate_series(0, size - 1) i
+$$ LANGUAGE sql;
+-- follow a flatbuffer offset
+CREATE FUNCTION arrow_ref(m bytea, pos bigint) RETURNS bigint
+AS $$ SELECT pos + arrow_uint(m, pos, 4) $$ LANGUAGE sql;
+-- position of a flatbuffer table field, NULL if absent
+CREATE FUNCTION arrow_field(m bytea, tab bigint, slot int) RETURNS bigint
+AS $$
+    SELECT CASE WHEN o > 0 THEN tab + o END
+    FROM (SELECT tab - (arrow_uint(m, tab, 4) # 2147483648 - 2147483648) AS vt) v,
+    LATERAL (SELECT CASE WHEN 4 + 2 * slot < arrow_uint(m, vt, 2)
+        THEN arrow_uint(m, vt + 4 + 2 * slot, 2) ELSE 0 END AS o) o
+$$ LANGUAGE sql;
+CREATE FUNCTION arrow_string(m bytea, pos bigint) RETURNS text
+AS $$
+    SELECT convert_from(substr(m, (s + 5)::int, arrow_uint(m, s, 4)::int), 'UTF8')
+    FROM (SELECT arrow_ref(m, pos) AS s) s
+$$ LANGUAGE sql;
+CREATE FUNCTION arrow_message(m bytea,
+    OUT header_type int, OUT valid_length bool, OUT nb_rows bigint,
+    OUT nb_nodes bigint, OUT valid_buffers bool, OUT stats jsonb)
+AS $$
+DECLARE
+    v_msg bigint;
+    v_batch bigint;
+    v_body bigint;
+    v_pos bigint;
+BEGIN
+    -- nothing to decode in the end of stream marker
+    IF m = '\xffffffff00000000'::bytea THEN
+        RETURN;
+    END IF;
+
+    -- the root table offset follows the continuation marker and the metadata
+    -- length, and the body follows the metadata
+    v_msg := arrow_ref(m, 8);
+    header_type := get_byte(m, arrow_field(m, v_msg, 1)::int);
+    v_body := coalesce(arrow_uint(m, arrow_field(m, v_msg, 3), 8), 0);
+    valid_length := length(m) = 8 + arrow_uint(m, 4, 4) + v_body;
+
+    IF header_type <> 3 THEN
+        RETURN;
+    END IF;
+
+    v_batch := arrow_ref(m, arrow_field(m, v_msg, 2));
+    nb_rows := arrow_uint(m, arrow_field(m, v_batch, 0), 8);
+    nb_nodes := arrow_uint(m, arrow_ref(m, arrow_field(m, v_batch, 1)), 4);
+
+    -- the buffers are (offset, length) structs, that should fit in the body
+    v_pos := arrow_ref(m, arrow_field(m, v_batch, 2));
+    SELECT bool_and(arrow_uint(m, v_pos + 4 + 16 * i, 8)
+        + arrow_uint(m, v_pos + 12 + 16 * i, 8) <= v_body)
+    INTO valid_buffers
+    FROM generate_series(0, arrow_uint(m, v_pos, 4) - 1) i;
+
+    -- the statistics are the only custom metadata
+    v_pos := arrow_ref(m, arrow_ref(m, arrow_field(m, v_msg, 4)) + 4);
+    IF arrow_string(m, arrow_field(m, v_pos, 0)) = 'powa:statistics' THEN
+        stats := arrow_string(m, arrow_field(m, v_pos, 1))::jsonb;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- A schema message, a record batch per 10000 rows with their statistics and
+-- the end of stream marker
+SELECT 3, count(*) = 2 + ceil(:nb_exported / 10000.0) AS nb_messages,
+    bool_and(num = 1) FILTER (WHERE d.header_type = 1) AS schema_first,
+    bool_and(d.header_type IS NULL) FILTER (WHERE num = nb) AS eos_last,
+    bool_and(substr(m, 1, 4) = '\xffffffff'::bytea) AS all_continuation,
+    bool_and(d.valid_length) AS valid_lengths,
+    sum(d.nb_rows) = :nb_exported AS all_rows,
+    bool_and(d.nb_rows <= 10000 AND d.valid_buffers
+        AND d.nb_nodes = jsonb_array_length(d.stats->'columns')
+        AND (d.stats->>'rows')::bigint = d.nb_rows)
+        FILTER (WHERE d.header_type = 3) AS valid_batches
+FROM (
+    SELECT num, m, count(*) OVER () AS nb
+    FROM "PoWA".powa_export_history(0, 'powa_statements_history')
+        WITH ORDINALITY m(m, num)
+) m,
+LATERAL arrow_message(m) d;
+DROP FUNCTION arrow_message(bytea), arrow_string(bytea, bigint),
+    arrow_field(bytea, bigint, int), arrow_ref(bytea, bigint),
+    arrow_uint(bytea, bigint, int);
+
+-- Test the merged per-query history
+SELECT 3, count(*) > 0 AND bool_and(h.intvl IS NOT NULL)
+FROM (
+    SELECT queryid, dbid, userid, toplevel
+    FROM "PoWA".powa_statements_history
+    WHERE srvid = 0
+    ORDER BY cardinality(records) DESC, queryid
+    LIMIT 1
+) q,
+LATERAL "PoWA".powa_get_query_history(0, q.queryid, q.dbid, q.userid,
+    '-infinity', 'infinity', q.toplevel) h;
+
+-- Test the co-located per-query history layout, keeping the coalesce sequence
+SELECT "PoWA".powa_activate_query_history(0);
+-- snapshots taken in the same statement would have the same timestamp
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_take_snapshot();
+SELECT 3, count(*) > 0 FROM "PoWA".powa_query_history;
+-- It should return the same data as the data sources
+WITH q AS (
+    SELECT queryid, dbid, userid, toplevel, enabled_at
+    FROM "PoWA".powa_query_history
+    JOIN "PoWA".powa_query_history_config USING (srvid)
+    WHERE srvid = 0
+    ORDER BY cardinality(records) DESC, queryid
+    LIMIT 1
+),
+colocated AS (
+    SELECT h.*
+    FROM q, LATERAL "PoWA".powa_get_query_history(0, q.queryid, q.dbid,
+        q.userid, q.enabled_at, 'infinity', q.toplevel) h
+),
+sources AS (
+    SELECT h.*
+    FROM q, LATERAL "PoWA".powa_get_query_history(0, q.queryid, q.dbid,
+        q.userid, q.enabled_at - '1 microsecond'::interval, 'infinity',
+        q.toplevel) h
+)
+SELECT 3, (SELECT count(*) FROM colocated) > 0,
+    (SELECT count(*) FROM (
+        (TABLE colocated EXCEPT TABLE sources)
+        UNION ALL
+        (TABLE sources EXCEPT TABLE colocated)
+    ) d) AS nb_diff;
+-- Both layouts should compute the wait events difference with the previous
+-- occurrence of the same event, even if it's missing from some snapshots, and
+-- the data sources should be used if some records are missing from the
+-- co-located history because its aggregation failed.  Use a fake server with
+-- crafted records, so all the aggregations can be run manually.
+INSERT INTO "PoWA".powa_servers (id, hostname, port, username, dbname)
+VALUES (42, 'fake', 5432, 'powa', 'powa');
+INSERT INTO "PoWA".powa_query_history_config (srvid, enabled_at)
+VALUES (42, '2100-01-01');
+CREATE TEMP TABLE fake_snapshots AS
+    SELECT n, '2100-01-01'::timestamptz + n * interval '1 minute' AS ts
+    FROM generate_series(0, 5) n;
+CREATE FUNCTION fake_snapshots(_from int, _to int) RETURNS void AS $$
+    INSERT INTO "PoWA".powa_statements_history_current (srvid, queryid, dbid,
+        userid, toplevel, record)
+    SELECT 42, 1, 1, 1, true, jsonb_populate_record(r.record,
+        jsonb_build_object('ts', f.ts, 'calls', f.n * 10))
+    FROM (SELECT record
+        FROM "PoWA".powa_statements_history_current
+        WHERE srvid = 0
+        LIMIT 1) r
+    CROSS JOIN fake_snapshots f
+    WHERE f.n BETWEEN _from AND _to;
+    -- the second event is missing from the second snapshot
+    INSERT INTO "PoWA".powa_wait_sampling_history_current (srvid, queryid,
+        dbid, event_type, event, record)
+    SELECT 42, 1, 1, 'LWLock', e.event,
+        ROW(f.ts, f.n * e.mult)::"PoWA".powa_wait_sampling_history_record
+    FROM fake_snapshots f
+    CROSS JOIN (VALUES ('first', 2), ('second', 3)) e(event, mult)
+    WHERE f.n BETWEEN _from AND _to
+    AND (e.event = 'first' OR f.n <> 1);
+$$ LANGUAGE sql;
+CREATE FUNCTION fake_history_diff() RETURNS TABLE (nb_colocated bigint,
+    nb_sources bigint, nb_diff bigint) AS $$
+    WITH colocated AS (
+        SELECT * FROM "PoWA".powa_get_query_history(42, 1, 1, 1,
+            '2100-01-01', 'infinity')
+    ),
+    sources AS (
+        SELECT * FROM "PoWA".powa_get_query_history(42, 1, 1, 1,
+            '-infinity', 'infinity')
+    )
+    SELECT (SELECT count(*) FROM colocated), (SELECT count(*) FROM sources),
+        (SELECT count(*) FROM (
+            (TABLE colocated EXCEPT TABLE sources)
+            UNION ALL
+            (TABLE sources EXCEPT TABLE colocated)
+        ) d);
+$$ LANGUAGE sql;
+SELECT fake_snapshots(0, 2);
+SELECT "PoWA".powa_query_history_aggregate(42);
+SELECT "PoWA".powa_statements_aggregate(42);
+SELECT "PoWA".powa_wait_sampling_aggregate(42);
+SELECT 3, * FROM fake_history_diff();
+SELECT 3, ts, wait_events
+FROM "PoWA".powa_get_query_history(42, 1, 1, 1, '2100-01-01', 'infinity');
+-- the co-located history aggregation failed for those records
+SELECT fake_snapshots(3, 5);
+SELECT "PoWA".powa_statements_aggregate(42);
+SELECT "PoWA".powa_wait_sampling_aggregate(42);
+SELECT 3, * FROM fake_history_diff();
+DROP FUNCTION fake_history_diff();
+DROP FUNCTION fake_snapshots(int, int);
+DROP TABLE fake_snapshots;
+DELETE FROM "PoWA".powa_servers WHERE id = 42;
+
+SELECT "PoWA".powa_deactivate_query_history(0);
+SELECT 3, count(*) = 0 FROM "PoWA".powa_query_history;
+
 -- This snapshot will trigger the purge
 SELECT "PoWA".powa_take_snapshot();
 
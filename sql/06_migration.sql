@@ -0,0 +1,144 @@
+-- General setup
+\set SHOW_CONTEXT never
+
+-- Nothing to do if no job is registered
+SELECT "PoWA".powa_run_migration_jobs();
+
+-- Jobs can only be processed in batches with TID range scans
+SELECT CASE WHEN current_setting('server_version_num')::int >= 140000
+    THEN '1' ELSE 'NULL' END AS nb_blocks \gset
+
+-- Get some data to migrate
+LOAD 'powa';
+-- snapshots taken in the same statement would have the same timestamp
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_take_snapshot();
+SELECT count(*) > 0 FROM "PoWA".powa_statements_history_current;
+
+-- Conversion functions, as an upgrade script would create them
+CREATE FUNCTION "PoWA".powa_test_abs_calls(r "PoWA".powa_statements_history_record)
+RETURNS "PoWA".powa_statements_history_record
+AS $$
+BEGIN
+    r.calls := abs(r.calls);
+    RETURN r;
+END;
+$$ LANGUAGE plpgsql IMMUTABLE;
+CREATE FUNCTION "PoWA".powa_test_fail(i integer)
+RETURNS integer
+AS $$ SELECT i / 0 $$ LANGUAGE sql IMMUTABLE;
+CREATE FUNCTION "PoWA".powa_test_not_member(i integer)
+RETURNS integer
+AS $$ SELECT i $$ LANGUAGE sql IMMUTABLE;
+ALTER EXTENSION powa ADD FUNCTION "PoWA".powa_test_abs_calls("PoWA".powa_statements_history_record);
+ALTER EXTENSION powa ADD FUNCTION "PoWA".powa_test_fail(integer);
+
+-- Some rows in the old format, only for the last snapshot so that the
+-- history helpers would compute negative deltas
+UPDATE "PoWA".powa_statements_history_current
+SET record.calls = -(record).calls
+WHERE (record).ts = (SELECT max((record).ts)
+    FROM "PoWA".powa_statements_history_current);
+
+SELECT "PoWA".powa_register_migration_job('test job', 'does_not_exist',
+    'record', 'powa_test_abs_calls');
+-- Only extension functions of the right datatype can be used
+SELECT "PoWA".powa_register_migration_job('test job',
+    'powa_statements_history_current', 'srvid', 'powa_test_not_member');
+SELECT "PoWA".powa_register_migration_job('test job',
+    'powa_statements_history_current', 'srvid', 'powa_test_abs_calls');
+SELECT "PoWA".powa_register_migration_job('test job',
+    'powa_statements_history_current', 'record', 'powa_test_abs_calls; DROP TABLE "PoWA".powa_servers');
+SELECT "PoWA".powa_register_migration_job('failing job',
+    'powa_statements_history_current', 'srvid', 'powa_test_fail');
+SELECT "PoWA".powa_register_migration_job('test job',
+    'powa_statements_history_current', 'record', 'powa_test_abs_calls');
+SELECT "PoWA".powa_register_migration_job('test job',
+    'powa_statements_history_current', 'record', 'powa_test_abs_calls');
+
+-- The pending conversions should be applied when reading the history
+SELECT count(*) FILTER (WHERE (record).calls < 0) > 0 AS has_old_rows,
+    count(*) FILTER (WHERE ("PoWA".powa_migration_read(record)).calls < 0)
+        AS nb_old_read
+FROM "PoWA".powa_statements_history_current;
+
+-- Including in the history reading functions
+SELECT count(*) > 0 AS has_history,
+    count(*) FILTER (WHERE (h.statements).calls < 0) AS nb_old_history
+FROM (
+    SELECT DISTINCT queryid, dbid, userid, toplevel
+    FROM "PoWA".powa_statements_history_current
+    WHERE srvid = 0
+) q,
+LATERAL "PoWA".powa_get_query_history(0, q.queryid, q.dbid, q.userid,
+    '-infinity', 'infinity', q.toplevel) h;
+
+CREATE FUNCTION powa_test_export_old_rows(_relname text, OUT nb_rows bigint,
+    OUT nb_old_rows bigint)
+AS $$
+BEGIN
+    EXECUTE format('SELECT count(*), count(*) FILTER (WHERE calls < 0) FROM (%s) s',
+        "PoWA".powa_export_history_query(_relname))
+    INTO nb_rows, nb_old_rows
+    USING 0, '-infinity'::timestamptz, 'infinity'::timestamptz;
+END;
+$$ LANGUAGE plpgsql;
+SELECT nb_rows > 0 AS has_rows, nb_old_rows
+FROM powa_test_export_old_rows('powa_statements_history');
+DROP FUNCTION powa_test_export_old_rows(text);
+
+-- Process the jobs, one block at a time if possible.  The failing job
+-- shouldn't prevent the valid one from being processed.
+SELECT count(*) > 0
+FROM generate_series(1, 1000)
+WHERE "PoWA".powa_run_migration_jobs(:nb_blocks);
+
+SELECT jobname, finished_at IS NOT NULL AS finished,
+    finished_at IS NOT NULL AND next_block = nb_blocks AS all_blocks_done,
+    finished_at IS NOT NULL
+        AND nb_rows = (SELECT count(*) FROM "PoWA".powa_statements_history_current)
+        AS all_rows_done,
+    nb_failures,
+    retry_at > now() AS backed_off, last_error
+FROM "PoWA".powa_migration_jobs
+ORDER BY registered_at, jobname;
+
+SELECT count(*) FILTER (WHERE (record).calls < 0) AS nb_old_rows
+FROM "PoWA".powa_statements_history_current;
+
+-- The failing job should be retried once its backoff delay expired
+SELECT "PoWA".powa_run_migration_jobs(:nb_blocks);
+UPDATE "PoWA".powa_migration_jobs SET retry_at = now()
+WHERE jobname = 'failing job';
+SELECT "PoWA".powa_run_migration_jobs(:nb_blocks);
+SELECT jobname, finished_at IS NOT NULL AS finished, nb_failures, retry_at - last_run AS backoff, last_error
+FROM "PoWA".powa_migration_jobs
+WHERE jobname = 'failing job';
+
+-- A job that isn't valid anymore should never be run again
+ALTER EXTENSION powa DROP FUNCTION "PoWA".powa_test_fail(integer);
+UPDATE "PoWA".powa_migration_jobs SET retry_at = now()
+WHERE jobname = 'failing job';
+SELECT "PoWA".powa_run_migration_jobs(:nb_blocks);
+SELECT jobname, nb_failures, retry_at, last_error
+FROM "PoWA".powa_migration_jobs
+WHERE jobname = 'failing job';
+DELETE FROM "PoWA".powa_migration_jobs WHERE jobname = 'failing job';
+
+-- A rewritten relation should be processed again from the beginning
+UPDATE "PoWA".powa_migration_jobs SET finished_at = NULL
+WHERE jobname = 'test job';
+VACUUM FULL "PoWA".powa_statements_history_current;
+SELECT "PoWA".powa_run_migration_jobs(:nb_blocks);
+SELECT jobname, next_block = nb_blocks AS all_blocks_done,
+    nb_rows = (SELECT count(*) FROM "PoWA".powa_statements_history_current) AS all_rows_done,
+    finished_at IS NOT NULL AS finished
+FROM "PoWA".powa_migration_jobs
+WHERE jobname = 'test job';
+
+DELETE FROM "PoWA".powa_migration_jobs;
+ALTER EXTENSION powa DROP FUNCTION "PoWA".powa_test_abs_calls("PoWA".powa_statements_history_record);
+DROP FUNCTION "PoWA".powa_test_abs_calls("PoWA".powa_statements_history_record);
+DROP FUNCTION "PoWA".powa_test_fail(integer);
+DROP FUNCTION "PoWA".powa_test_not_member(integer);
+SELECT * from "PoWA".powa_reset(0);
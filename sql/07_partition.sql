@@ -0,0 +1,160 @@
+-- General setup
+\set SHOW_CONTEXT never
+
+-- The history tables layout is chosen when the extension is created, so use a
+-- dedicated database to test the server partitioning
+SELECT current_database() AS regdb \gset
+CREATE DATABASE powa_partition;
+\c powa_partition
+SET client_min_messages = warning;
+CREATE SCHEMA "PGSS";
+CREATE EXTENSION pg_stat_statements WITH SCHEMA "PGSS";
+CREATE EXTENSION btree_gist;
+CREATE SCHEMA "PoWA";
+SET powa.partition_by_server = on;
+CREATE EXTENSION powa WITH SCHEMA "PoWA";
+RESET powa.partition_by_server;
+RESET client_min_messages;
+
+-- All the history tables should be partitioned, and only them
+SELECT c.relkind, count(*) > 0 AS has_tables,
+    bool_and(c.relname ~ '_history(_db)?(_current(_db)?)?$'
+        OR c.relname LIKE 'powa\_kcache\_metrics%') AS all_history
+FROM pg_depend d
+JOIN pg_extension e ON d.refclassid = 'pg_extension'::regclass
+    AND e.oid = d.refobjid
+    AND e.extname = 'powa'
+JOIN pg_class c ON d.classid = 'pg_class'::regclass
+    AND c.oid = d.objid
+WHERE c.relkind IN ('r', 'p')
+AND EXISTS (SELECT 1 FROM pg_attribute a
+    WHERE a.attrelid = c.oid AND a.attname = 'srvid')
+GROUP BY c.relkind
+ORDER BY c.relkind;
+
+-- The local server partitions should exist, and be part of the extension
+-- with their data dumped, as CREATE EXTENSION creates them
+SELECT count(*) > 0 AS has_parts,
+    count(*) FILTER (WHERE d.objid IS NULL) AS nb_not_members,
+    count(*) FILTER (WHERE p <> ALL (e.extconfig)) AS nb_not_dumped
+FROM "PoWA".powa_server_partitions(0) p
+LEFT JOIN pg_depend d ON d.classid = 'pg_class'::regclass
+    AND d.objid = p
+    AND d.deptype = 'e'
+CROSS JOIN pg_extension e
+WHERE e.extname = 'powa';
+
+-- The layout should be recorded
+SELECT * FROM "PoWA".powa_partitioned_servers;
+
+-- powa_admin should be able to manage the servers
+SET client_min_messages = warning;
+SELECT "PoWA".setup_powa_roles(true);
+RESET client_min_messages;
+GRANT USAGE ON SCHEMA "PoWA" TO powa_admin;
+
+-- Registering a server should create its partitions, as regular tables that
+-- pg_dump dumps with their data, and with the same privileges as their parent
+SET ROLE powa_admin;
+SELECT "PoWA".powa_register_server(hostname => 'srv1',
+    extensions => '{pg_qualstats}');
+RESET ROLE;
+SELECT * FROM "PoWA".powa_partitioned_servers;
+SELECT count(*) = (SELECT count(*) FROM "PoWA".powa_server_partitions(0))
+    AS all_created,
+    count(*) FILTER (WHERE EXISTS (SELECT 1 FROM pg_depend d
+        WHERE d.classid = 'pg_class'::regclass
+        AND d.objid = p
+        AND d.deptype = 'e')) AS nb_members,
+    count(*) FILTER (WHERE p = ANY (e.extconfig)) AS nb_dumped,
+    count(*) FILTER (WHERE
+        (SELECT array_agg(a::text ORDER BY a::text) FROM aclexplode(c.relacl) a)
+        IS DISTINCT FROM
+        (SELECT array_agg(a::text ORDER BY a::text) FROM aclexplode(pc.relacl) a)
+    ) AS nb_wrong_acl
+FROM "PoWA".powa_server_partitions(1) p
+JOIN pg_class c ON c.oid = p
+JOIN pg_inherits i ON i.inhrelid = p
+JOIN pg_class pc ON pc.oid = i.inhparent
+CROSS JOIN pg_extension e
+WHERE e.extname = 'powa';
+
+-- Partitions of coalesced tables should have aggressive toasting
+SELECT p AS missing_toast_tuple_target
+FROM "PoWA".powa_server_partitions(1) p
+JOIN pg_class c ON c.oid = p
+WHERE EXISTS (SELECT 1 FROM pg_attribute a
+    WHERE a.attrelid = c.oid AND a.attname = 'mins_in_range')
+AND 'toast_tuple_target=128' <> ALL(coalesce(c.reloptions, '{}'));
+
+-- Local snapshots should only go in the local server partitions
+LOAD 'powa';
+SELECT "PoWA".powa_take_snapshot();
+SELECT count(*) > 0 AS has_rows
+FROM "PoWA".powa_statements_history_current_srv0;
+SELECT count(*) AS nb_rows FROM "PoWA".powa_statements_history_current_srv1;
+
+-- Resetting the local server should empty its partitions
+SELECT "PoWA".powa_reset(0);
+SELECT count(*) AS nb_rows FROM "PoWA".powa_statements_history_current;
+
+-- Migration jobs on partitioned tables should process each partition
+CREATE FUNCTION "PoWA".powa_test_convert(r "PoWA".powa_statements_history_record)
+RETURNS "PoWA".powa_statements_history_record
+AS $$ SELECT r $$ LANGUAGE sql IMMUTABLE;
+ALTER EXTENSION powa ADD FUNCTION "PoWA".powa_test_convert("PoWA".powa_statements_history_record);
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_register_migration_job('test job',
+    'powa_statements_history_current', 'record', 'powa_test_convert');
+SELECT count(*) > 0
+FROM generate_series(1, 10)
+WHERE "PoWA".powa_run_migration_jobs(NULL);
+SELECT jobname, relname, finished_at IS NOT NULL AS finished,
+    nb_rows > 0 AS has_rows
+FROM "PoWA".powa_migration_jobs
+ORDER BY jobname;
+DELETE FROM "PoWA".powa_migration_jobs;
+ALTER EXTENSION powa DROP FUNCTION "PoWA".powa_test_convert("PoWA".powa_statements_history_record);
+DROP FUNCTION "PoWA".powa_test_convert("PoWA".powa_statements_history_record);
+
+-- Deleting a server should drop its partitions
+SET ROLE powa_admin;
+SELECT "PoWA".powa_delete_and_purge_server(1);
+RESET ROLE;
+SELECT count(*) AS nb_parts FROM "PoWA".powa_server_partitions(1);
+SELECT count(*) AS nb_rels FROM pg_class
+WHERE relname = 'powa_statements_history_srv1';
+SELECT * FROM "PoWA".powa_partitioned_servers;
+
+-- Rows that already exist should be ignored, as pg_restore restores rows that
+-- CREATE EXTENSION or the powa_servers trigger already inserted
+INSERT INTO "PoWA".powa_partitioned_servers VALUES (0);
+SELECT * FROM "PoWA".powa_partitioned_servers;
+
+-- Only empty history tables can be partitioned
+\c :regdb
+DROP DATABASE powa_partition;
+CREATE DATABASE powa_partition;
+\c powa_partition
+SET client_min_messages = warning;
+CREATE SCHEMA "PGSS";
+CREATE EXTENSION pg_stat_statements WITH SCHEMA "PGSS";
+CREATE EXTENSION btree_gist;
+CREATE SCHEMA "PoWA";
+CREATE EXTENSION powa WITH SCHEMA "PoWA" VERSION '5.1.2';
+RESET client_min_messages;
+LOAD 'powa';
+SELECT "PoWA".powa_take_snapshot();
+SET powa.partition_by_server = on;
+ALTER EXTENSION powa UPDATE TO '5.2.0';
+RESET powa.partition_by_server;
+
+-- and only by the extension scripts
+ALTER EXTENSION powa UPDATE TO '5.2.0';
+INSERT INTO "PoWA".powa_partitioned_servers VALUES (0);
+SELECT count(*) AS nb_partitioned FROM pg_class WHERE relkind = 'p';
+SELECT count(*) AS nb_servers FROM "PoWA".powa_partitioned_servers;
+
+-- Cleanup
+\c :regdb
+DROP DATABASE powa_partition;
@@ -0,0 +1,107 @@
+-- General setup
+\set SHOW_CONTEXT never
+
+-- The layout is recorded, so a btree index on the coalesced ranges created by
+-- a DBA shouldn't switch the history tables to the btree layout
+SELECT method FROM "PoWA".powa_history_index_config;
+CREATE INDEX powa_test_btree ON "PoWA".powa_statements_history
+    USING btree (srvid, upper(coalesce_range));
+SELECT "PoWA".powa_setup_history_indexes();
+SELECT method FROM "PoWA".powa_history_index_config;
+SELECT am.amname <> 'btree' AS kept
+FROM pg_class c
+JOIN pg_am am ON am.oid = c.relam
+WHERE c.oid = '"PoWA".powa_statements_history_query_ts'::regclass;
+DROP INDEX "PoWA".powa_test_btree;
+
+-- The history tables index layout is chosen when the extension is created, so
+-- use a dedicated database to test the btree layout
+SELECT current_database() AS regdb \gset
+CREATE DATABASE powa_history_index;
+\c powa_history_index
+SET client_min_messages = warning;
+CREATE SCHEMA "PGSS";
+CREATE EXTENSION pg_stat_statements WITH SCHEMA "PGSS";
+CREATE EXTENSION btree_gist;
+CREATE SCHEMA "PoWA";
+SET powa.history_index = btree;
+CREATE EXTENSION powa WITH SCHEMA "PoWA";
+RESET powa.history_index;
+RESET client_min_messages;
+SELECT method FROM "PoWA".powa_history_index_config;
+
+-- No index should be on the coalesce_range column anymore, apart from the
+-- constraints ones
+SELECT i.indexrelid::regclass AS range_index
+FROM pg_depend d
+JOIN pg_extension e ON d.refclassid = 'pg_extension'::regclass
+    AND e.oid = d.refobjid
+    AND e.extname = 'powa'
+JOIN pg_index i ON d.classid = 'pg_class'::regclass
+    AND i.indrelid = d.objid
+JOIN pg_attribute a ON a.attrelid = i.indrelid
+    AND a.attnum = ANY (i.indkey)
+WHERE a.attname = 'coalesce_range'
+AND NOT EXISTS (SELECT 1 FROM pg_constraint con
+    WHERE con.conindid = i.indexrelid)
+ORDER BY 1;
+
+-- The statements range index should have been replaced
+SELECT pg_get_indexdef('"PoWA".powa_statements_history_query_ts'::regclass);
+
+-- Indexes that are not a plain list of columns should be left alone
+CREATE INDEX powa_test_partial ON "PoWA".powa_statements_history
+    USING gist (coalesce_range) WHERE srvid = 0;
+CREATE INDEX powa_test_expr ON "PoWA".powa_statements_history
+    USING gist (coalesce_range, tstzrange(lower(coalesce_range), NULL));
+SELECT "PoWA".powa_setup_history_indexes();
+SELECT pg_get_indexdef(indexrelid)
+FROM pg_index
+WHERE indexrelid::regclass::text LIKE '%powa\_test\_%'
+ORDER BY indexrelid::regclass::text;
+DROP INDEX "PoWA".powa_test_partial, "PoWA".powa_test_expr;
+
+-- Coalesced records should still be found by the read functions
+LOAD 'powa';
+SET powa.coalesce = 5;
+-- snapshots taken in the same statement would have the same timestamp
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_take_snapshot();
+SELECT "PoWA".powa_take_snapshot();
+SELECT count(*) > 0 AS has_history FROM "PoWA".powa_stat_activity_history;
+SELECT count(DISTINCT ts) = 6 AS all_found
+FROM "PoWA".powa_stat_get_activity(0, '-infinity', 'infinity');
+
+-- and the btree indexes should be used for the redundant upper(coalesce_range)
+-- clause of their queries
+CREATE FUNCTION powa_test_uses_index(_relname text, _index text,
+    OUT uses_index boolean, OUT uses_upper boolean)
+AS $$
+DECLARE
+    v_line text;
+BEGIN
+    uses_index := false;
+    uses_upper := false;
+    EXECUTE format('PREPARE powa_test_query(int, timestamptz, timestamptz) AS %s',
+        "PoWA".powa_export_history_query(_relname));
+    FOR v_line IN
+        EXPLAIN (COSTS OFF) EXECUTE powa_test_query(0, now(), 'infinity')
+    LOOP
+        uses_index := uses_index OR v_line LIKE '%' || _index || '%';
+        uses_upper := uses_upper
+            OR v_line LIKE '%Index Cond: %upper(coalesce_range) >=%';
+    END LOOP;
+    DEALLOCATE powa_test_query;
+END;
+$$ LANGUAGE plpgsql;
+SET enable_seqscan = off;
+SELECT * FROM powa_test_uses_index('powa_stat_activity_history',
+    'powa_stat_activity_history_ts');
+RESET enable_seqscan;
+
+-- Cleanup
+\c :regdb
+DROP DATABASE powa_history_index;
@@ -64,7 +64,9 @@ AS $$
 $$ LANGUAGE sql;
 
 
--- powa_admin should have all privileges on all relations
+-- powa_admin should have all privileges on all relations, except writing the
+-- migration jobs, the partitioned servers and the history index layout, which
+-- are maintained by the extension owner
 SELECT powa_role, relname, priv
 FROM check_has_privilege('powa_admin',
     array ['SELECT', 'INSERT', 'UPDATE', 'DELETE', 'TRUNCATE', 'REFERENCES',